@@ -1,109 +1,2110 @@
 #include "embtrefftz.hpp"
 #include <bla.hpp>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <random>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+namespace ngbla{
+
+#ifdef LAPACK
+    // optimal workspace of a LAPACK routine, queried once per matrix shape and thread
+    struct LapackWorkSize { ngbla::integer lwork = 0, lrwork = 0, liwork = 0; };
+    typedef std::map<std::pair<int,int>,LapackWorkSize> WorkSizeTable;
+
+    template <typename TQUERY>
+    LapackWorkSize GetWorkSize (WorkSizeTable & table, int m, int n, TQUERY query)
+    {
+        auto it = table.find(std::make_pair(m,n));
+        if(it != table.end())
+            return it->second;
+        LapackWorkSize ws = query();
+        table[std::make_pair(m,n)] = ws;
+        return ws;
+    }
+
+    void LapackSVD (SliceMatrix<double, ColMajor> A,
+                    SliceMatrix<double, ColMajor> U,
+                    SliceMatrix<double, ColMajor> V,
+                    LocalHeap & lh)
+    {
+        static Timer t("LapackSVD"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer n = A.Width(), m = A.Height();
+        FlatVector<> S(min(n,m),lh);
+        FlatArray<ngbla::integer> iwork(8*min(n,m),lh);
+        ngbla::integer info;
+        char jobz = 'A';
+        ngbla::integer lda = A.Dist(), ldu = U.Dist(), ldv = V.Dist();
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, m, n, [&] ()
+        {
+            double optwork;
+            ngbla::integer lwork = -1;
+            dgesdd_ ( &jobz, &m, &n, A.Data(), &lda, S.Data(),
+                     U.Data(), &ldu, V.Data(), &ldv,
+                     &optwork, &lwork, iwork.Data(), &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork);
+            return res;
+        });
+        FlatArray<double> work(ws.lwork,lh);
+        ngbla::integer lwork = ws.lwork;
+
+        dgesdd_ ( &jobz, &m, &n, A.Data(), &lda,
+                 S.Data(),
+                 U.Data(), &ldu, V.Data(), &ldv,
+                 work.Data(), &lwork, iwork.Data(),
+                 &info);
+        if(info!=0)
+            throw Exception("something went wrong in the svd " + std::to_string(info));
+        A = 0.0;
+        A.Diag(0) = S;
+    }
+
+    void LapackSVD (SliceMatrix<Complex, ColMajor> A,
+                    SliceMatrix<Complex, ColMajor> U,
+                    SliceMatrix<Complex, ColMajor> V,
+                    LocalHeap & lh)
+    {
+        static Timer t("LapackSVD"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer n = A.Width(), m = A.Height();
+        FlatVector<> S(min(n,m),lh);
+        FlatArray<ngbla::integer> iwork(8*min(n,m),lh);
+        FlatArray<double> rwork(5*max(n,m)*min(n,m)+5*min(n,m),lh);
+        ngbla::integer info;
+        char jobz = 'A';
+        ngbla::integer lda = A.Dist(), ldu = U.Dist(), ldv = V.Dist();
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, m, n, [&] ()
+        {
+            Complex optwork;
+            ngbla::integer lwork = -1;
+            zgesdd_ ( &jobz, &m, &n, A.Data(), &lda, S.Data(),
+                     U.Data(), &ldu, V.Data(), &ldv,
+                     &optwork, &lwork, rwork.Data(), iwork.Data(), &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork.real());
+            return res;
+        });
+        FlatArray<Complex> work(ws.lwork,lh);
+        ngbla::integer lwork = ws.lwork;
+
+        zgesdd_ ( &jobz, &m, &n, A.Data(), &lda,
+                 S.Data(),
+                 U.Data(), &ldu, V.Data(), &ldv,
+                 work.Data(), &lwork, rwork.Data(), iwork.Data(),
+                 &info);
+        if(info!=0)
+            throw Exception("something went wrong in the svd " + std::to_string(info));
+        A = 0.0;
+        A.Diag(0) = S;
+    }
+
+    void LapackEigSymmetric (SliceMatrix<double, ColMajor> A, SliceVector<double> lami, LocalHeap & lh)
+    {
+        static Timer t("LapackEigSymmetric"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer n = A.Width();
+        ngbla::integer info;
+        char jobz = 'V', uplo = 'U';
+        ngbla::integer lda = A.Dist();
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, n, n, [&] ()
+        {
+            double optwork;
+            ngbla::integer optiwork;
+            ngbla::integer lwork = -1, liwork = -1;
+            dsyevd_ ( &jobz, &uplo, &n, A.Data(), &lda, lami.Data(),
+                     &optwork, &lwork, &optiwork, &liwork, &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork);
+            res.liwork = optiwork;
+            return res;
+        });
+        FlatArray<double> work(ws.lwork,lh);
+        FlatArray<ngbla::integer> iwork(ws.liwork,lh);
+        ngbla::integer lwork = ws.lwork, liwork = ws.liwork;
+
+        dsyevd_ ( &jobz, &uplo, &n, A.Data(), &lda,
+                 lami.Data(),
+                 work.Data(), &lwork, iwork.Data(), &liwork,
+                 &info);
+        if(info!=0)
+            throw Exception("something went wrong in the eigen solver " + std::to_string(info));
+    }
+
+    void LapackEigSymmetric (SliceMatrix<Complex, ColMajor> A, SliceVector<double> lami, LocalHeap & lh)
+    {
+        static Timer t("LapackEigSymmetric"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer n = A.Width();
+        ngbla::integer info;
+        char jobz = 'V', uplo = 'U';
+        ngbla::integer lda = A.Dist();
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, n, n, [&] ()
+        {
+            Complex optwork;
+            double optrwork;
+            ngbla::integer optiwork;
+            ngbla::integer lwork = -1, lrwork = -1, liwork = -1;
+            zheevd_ ( &jobz, &uplo, &n, A.Data(), &lda, lami.Data(),
+                     &optwork, &lwork, &optrwork, &lrwork, &optiwork, &liwork, &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork.real());
+            res.lrwork = ngbla::integer(optrwork);
+            res.liwork = optiwork;
+            return res;
+        });
+        FlatArray<Complex> work(ws.lwork,lh);
+        FlatArray<double> rwork(ws.lrwork,lh);
+        FlatArray<ngbla::integer> iwork(ws.liwork,lh);
+        ngbla::integer lwork = ws.lwork, lrwork = ws.lrwork, liwork = ws.liwork;
+
+        zheevd_ ( &jobz, &uplo, &n, A.Data(), &lda,
+                 lami.Data(),
+                 work.Data(), &lwork, rwork.Data(), &lrwork, iwork.Data(), &liwork,
+                 &info);
+        if(info!=0)
+            throw Exception("something went wrong in the eigen solver " + std::to_string(info));
+    }
+
+    /*
+       Singular values and right singular vectors (V=V^T) of A with at least
+       as many rows as columns. The left singular vectors are not formed,
+       jobz='O' overwrites A with them.
+    */
+    void LapackSVDRight (SliceMatrix<double, ColMajor> A,
+                         FlatVector<double> S,
+                         SliceMatrix<double, ColMajor> V,
+                         LocalHeap & lh)
+    {
+        static Timer t("LapackSVDRight"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer n = A.Width(), m = A.Height();
+        FlatArray<ngbla::integer> iwork(8*n,lh);
+        ngbla::integer info;
+        char jobz = 'O';
+        ngbla::integer lda = A.Dist(), ldu = 1, ldv = V.Dist();
+        double udummy;
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, m, n, [&] ()
+        {
+            double optwork;
+            ngbla::integer lwork = -1;
+            dgesdd_ ( &jobz, &m, &n, A.Data(), &lda, S.Data(),
+                     &udummy, &ldu, V.Data(), &ldv,
+                     &optwork, &lwork, iwork.Data(), &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork);
+            return res;
+        });
+        FlatArray<double> work(ws.lwork,lh);
+        ngbla::integer lwork = ws.lwork;
+
+        dgesdd_ ( &jobz, &m, &n, A.Data(), &lda, S.Data(),
+                 &udummy, &ldu, V.Data(), &ldv,
+                 work.Data(), &lwork, iwork.Data(), &info);
+        if(info!=0)
+            throw Exception("something went wrong in the svd " + std::to_string(info));
+    }
+
+    void LapackSVDRight (SliceMatrix<Complex, ColMajor> A,
+                         FlatVector<double> S,
+                         SliceMatrix<Complex, ColMajor> V,
+                         LocalHeap & lh)
+    {
+        static Timer t("LapackSVDRight"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer n = A.Width(), m = A.Height();
+        FlatArray<ngbla::integer> iwork(8*n,lh);
+        FlatArray<double> rwork(max(5*n*n+5*n, 2*m*n+2*n*n+n),lh);
+        ngbla::integer info;
+        char jobz = 'O';
+        ngbla::integer lda = A.Dist(), ldu = 1, ldv = V.Dist();
+        Complex udummy;
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, m, n, [&] ()
+        {
+            Complex optwork;
+            ngbla::integer lwork = -1;
+            zgesdd_ ( &jobz, &m, &n, A.Data(), &lda, S.Data(),
+                     &udummy, &ldu, V.Data(), &ldv,
+                     &optwork, &lwork, rwork.Data(), iwork.Data(), &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork.real());
+            return res;
+        });
+        FlatArray<Complex> work(ws.lwork,lh);
+        ngbla::integer lwork = ws.lwork;
+
+        zgesdd_ ( &jobz, &m, &n, A.Data(), &lda, S.Data(),
+                 &udummy, &ldu, V.Data(), &ldv,
+                 work.Data(), &lwork, rwork.Data(), iwork.Data(), &info);
+        if(info!=0)
+            throw Exception("something went wrong in the svd " + std::to_string(info));
+    }
+#endif
+
+    /*
+       Singular values (descending) and right singular vectors (V=V^H) of A,
+       without the left singular vectors. A is padded with zero rows if it
+       has fewer rows than columns.
+    */
+    template <class SCAL>
+    void GetSVDRight (SliceMatrix<SCAL, ColMajor> A,
+                      FlatVector<double> S,
+                      SliceMatrix<SCAL, ColMajor> V,
+                      LocalHeap & lh)
+    {
+        HeapReset hr(lh);
+        const size_t m = A.Height(), n = A.Width();
+        FlatMatrix<SCAL,ColMajor> AA(max(m,n),n,lh);
+        AA = 0.0;
+        AA.Rows(0,m) = A;
+#ifdef LAPACK
+        LapackSVDRight(AA,S,V,lh);
+#else
+        FlatMatrix<SCAL,ColMajor> U(max(m,n),max(m,n),lh);
+        CalcSVD(AA,U,V);
+        for(size_t i=0;i<n;i++)
+            S(i) = abs(AA(i,i));
+#endif
+    }
+
+    template <class SCAL>
+    void GetSVD (SliceMatrix<SCAL> A,
+                    SliceMatrix<SCAL, ColMajor> U,
+                    SliceMatrix<SCAL, ColMajor> V,
+                    LocalHeap & lh)
+    {
+        HeapReset hr(lh);
+        FlatMatrix<SCAL,ColMajor> AA(A.Height(),A.Width(),lh);
+        AA = A;
+#ifdef LAPACK
+        LapackSVD(AA,U,V,lh);
+#else
+        CalcSVD(AA,U,V);
+#endif
+        A = 0.0;
+        //A.Diag(0)=AA.Diag();
+        for(int i=0;i<min(A.Width(),A.Height());i++)
+            A(i,i)=AA(i,i);
+    }
+
+    /*
+       Same output as GetSVD, computed from the eigen decomposition of the
+       Gram matrix A^H A. Only the first min(m,n) columns of U are computed,
+       and only if U has nonzero width. The condition number is squared, so
+       singular values below sqrt(machine eps)*|A| are not resolved.
+    */
+    template <class SCAL>
+    void GetSVDFromGram (SliceMatrix<SCAL> A,
+                    SliceMatrix<SCAL, ColMajor> U,
+                    SliceMatrix<SCAL, ColMajor> V,
+                    LocalHeap & lh)
+    {
+#ifdef LAPACK
+        static Timer t("GetSVDFromGram"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        const size_t m = A.Height(), n = A.Width();
+        FlatMatrix<SCAL> AH(n,m,lh);
+        for(size_t i=0;i<m;i++)
+            for(size_t j=0;j<n;j++)
+                AH(j,i) = Conj(A(i,j));
+        FlatMatrix<SCAL,ColMajor> G(n,n,lh);
+        G = AH * A;
+        FlatVector<double> lami(n,lh);
+        LapackEigSymmetric(G,lami,lh);
+
+        // eigenvalues are ascending, singular values are sorted descending
+        const size_t k = min(m,n);
+        for(size_t i=0;i<n;i++)
+            for(size_t j=0;j<n;j++)
+                V(i,j) = Conj(G(j,n-1-i));
+        if(U.Width())
+        {
+            U = 0.0;
+            for(size_t i=0;i<k;i++)
+            {
+                double sigma = sqrt(max(lami(n-1-i),0.0));
+                if(sigma > 0)
+                    U.Col(i) = (1.0/sigma) * (A * G.Col(n-1-i));
+            }
+        }
+        A = 0.0;
+        for(size_t i=0;i<k;i++)
+            A(i,i) = sqrt(max(lami(n-1-i),0.0));
+#else
+        GetSVD<SCAL>(A,U,V,lh);
+#endif
+    }
+
+    template <class SCAL>
+    bool IsHermitian (SliceMatrix<SCAL> A)
+    {
+        if(A.Height() != A.Width())
+            return false;
+        double amax = 0, dmax = 0;
+        for(size_t i=0;i<A.Height();i++)
+            for(size_t j=0;j<=i;j++)
+            {
+                amax = max(amax, abs(A(i,j)));
+                dmax = max(dmax, abs(A(i,j) - Conj(A(j,i))));
+            }
+        return dmax <= 1e-12 * amax;
+    }
+
+    /*
+       Same output as GetSVD for Hermitian A, from the eigen decomposition
+       A = Q Lambda Q^H (zheevd/dsyevd instead of zgesdd/dgesdd): the singular
+       values are |lambda_i|, v_i = q_i and u_i = sign(lambda_i) q_i.
+       Falls back to GetSVD if A is not square and Hermitian.
+    */
+    template <class SCAL>
+    void GetSVDHermitian (SliceMatrix<SCAL> A,
+                    SliceMatrix<SCAL, ColMajor> U,
+                    SliceMatrix<SCAL, ColMajor> V,
+                    LocalHeap & lh)
+    {
+#ifdef LAPACK
+        if(!IsHermitian<SCAL>(A))
+        {
+            GetSVD<SCAL>(A,U,V,lh);
+            return;
+        }
+        static Timer t("GetSVDHermitian"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        const size_t n = A.Width();
+        FlatMatrix<SCAL,ColMajor> Q(n,n,lh);
+        Q = A;
+        FlatVector<double> lami(n,lh);
+        LapackEigSymmetric(Q,lami,lh);
+
+        // singular values are sorted descending
+        FlatArray<int> index(n,lh);
+        for(size_t i=0;i<n;i++) index[i] = i;
+        std::sort(index.Data(), index.Data()+n,
+                  [&] (int i, int j) { return fabs(lami(i)) > fabs(lami(j)); });
+        for(size_t i=0;i<n;i++)
+            for(size_t j=0;j<n;j++)
+                V(i,j) = Conj(Q(j,index[i]));
+        if(U.Width())
+            for(size_t i=0;i<n;i++)
+                U.Col(i) = (lami(index[i]) < 0 ? -1.0 : 1.0) * Q.Col(index[i]);
+        A = 0.0;
+        for(size_t i=0;i<n;i++)
+            A(i,i) = fabs(lami(index[i]));
+#else
+        GetSVD<SCAL>(A,U,V,lh);
+#endif
+    }
+
+    /*
+       Right null space of A, the nz smallest right singular vectors, by a
+       block Rayleigh-Ritz iteration (LOBPCG without preconditioner) from a
+       random start. A step applies A and A^H to about 3*nz vectors and
+       decomposes the small projected matrix, O(m n nz) instead of O(m n^2)
+       for the full SVD. The null vectors are returned in the last nz rows
+       of V (V=V^H as in GetSVD), the other rows are zero. Converged vectors
+       satisfy |A x| <= max(eps, 1e-12 |A|_F) and the residual of the normal
+       equations is below the same bound times |A|_F. Returns false if the
+       iteration does not converge or does not pay off.
+    */
+    template <class SCAL>
+    bool GetNullSpace (SliceMatrix<SCAL> A, int nz, double eps,
+                       SliceMatrix<SCAL, ColMajor> V,
+                       LocalHeap & lh)
+    {
+        static Timer t("GetNullSpace"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        const size_t m = A.Height(), n = A.Width();
+        const size_t b = min(n, size_t(nz + max(2, nz/2)));
+        if(nz <= 0 || 3*b >= n)
+            return false;
+
+        FlatMatrix<SCAL> AH(n,m,lh);
+        double normA2 = 0;
+        for(size_t i=0;i<m;i++)
+            for(size_t j=0;j<n;j++)
+            {
+                AH(j,i) = Conj(A(i,j));
+                normA2 += sqr(abs(A(i,j)));
+            }
+        const double normA = sqrt(normA2);
+        const double tolA = max(eps, 1e-12 * normA);
+
+        FlatMatrix<SCAL,ColMajor> S(n,3*b,lh), X(n,b,lh), R(n,b,lh), P(n,b,lh);
+        FlatMatrix<SCAL,ColMajor> AX(m,b,lh);
+        FlatVector<double> sigma(b,lh);
+        size_t np = 0;
+
+        std::mt19937 gen(n + 1000*m);
+        std::uniform_real_distribution<double> dist(-1.0,1.0);
+        for(size_t i=0;i<n;i++)
+            for(size_t j=0;j<b;j++)
+                X(i,j) = dist(gen);
+
+        // Gram-Schmidt (twice) of the columns [first,count) of S against the
+        // previous ones, nearly dependent columns are dropped
+        auto orthonormalize = [&] (size_t first, size_t count)
+        {
+            size_t s = first;
+            for(size_t j=first;j<count;j++)
+            {
+                double norm0 = L2Norm(S.Col(j));
+                if(norm0 == 0) continue;
+                S.Col(s) = S.Col(j);
+                for(int pass=0;pass<2;pass++)
+                    for(size_t l=0;l<s;l++)
+                    {
+                        SCAL ip = InnerProduct(Conj(S.Col(l)), S.Col(s));
+                        S.Col(s) -= ip * S.Col(l);
+                    }
+                double norm = L2Norm(S.Col(s));
+                if(norm > 1e-10 * norm0)
+                {
+                    S.Col(s) *= 1.0/norm;
+                    s++;
+                }
+            }
+            return s;
+        };
+
+        const int maxit = 200;
+        for(int it=0;it<maxit;it++)
+        {
+            HeapReset hr2(lh);
+            // basis [X, R, P], X is orthonormal after the first step
+            S.Cols(0,b) = X;
+            size_t nx = (it == 0) ? orthonormalize(0,b) : b;
+            size_t s = nx;
+            if(it > 0)
+            {
+                S.Cols(nx,nx+b) = R;
+                S.Cols(nx+b,nx+b+np) = P.Cols(0,np);
+                s = orthonormalize(nx,nx+b+np);
+            }
+            if(s < b)
+                return false;
+
+            // Rayleigh-Ritz from the SVD of A*S, not from S^H A^H A S,
+            // only the right singular vectors are formed
+            FlatMatrix<SCAL,ColMajor> AS(m,s,lh), W(s,s,lh);
+            FlatVector<double> sas(s,lh);
+            AS = A * S.Cols(0,s);
+            GetSVDRight<SCAL>(AS,sas,W,lh);
+
+            FlatVector<SCAL> w(s,lh);
+            for(size_t j=0;j<b;j++)
+            {
+                size_t k = s-1-j;
+                for(size_t l=0;l<s;l++)
+                    w(l) = Conj(W(k,l));
+                sigma(j) = sas(k);
+                X.Col(j) = S.Cols(0,s) * w;
+                P.Col(j) = S.Cols(nx,s) * w.Range(nx,s);
+            }
+            np = (s > nx) ? b : 0;
+
+            // residuals of A and of the normal equations
+            AX = A * X;
+            R = AH * AX;
+            double resmax = 0, nresmax = 0;
+            for(size_t j=0;j<b;j++)
+            {
+                R.Col(j) -= sqr(sigma(j)) * X.Col(j);
+                if(j < size_t(nz))
+                {
+                    resmax = max(resmax, L2Norm(AX.Col(j)));
+                    nresmax = max(nresmax, L2Norm(R.Col(j)));
+                }
+            }
+            if(resmax <= tolA && nresmax <= tolA * normA)
+            {
+                V = 0.0;
+                for(int j=0;j<nz;j++)
+                    for(size_t l=0;l<n;l++)
+                        V(n-nz+j,l) = Conj(X(l,j));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+       Null space of A from a single precision SVD, refined by one Newton
+       step in double: the residual A*Z of the candidate null vectors is
+       corrected with the pseudo inverse on the range, from the single
+       precision factors, followed by a Rayleigh-Ritz step. Candidates are
+       the singular vectors below max(eps, releps*sigma_max) or at the single
+       precision rounding level, and at least the last tndof ones. Same output
+       as GetSVD without U. Returns false, with A unchanged, if the vectors
+       at the rounding level are not refined to double accuracy.
+    */
+    bool GetNullSpaceMixed (SliceMatrix<double> A, double eps, double releps, int tndof,
+                            SliceMatrix<double, ColMajor> V, LocalHeap & lh)
+    {
+#ifdef LAPACK
+        static Timer t("GetNullSpaceMixed"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        ngbla::integer m = A.Height(), n = A.Width();
+        const int k = min(m,n);
+        if(k == 0)
+            return false;
+        // with at least as many rows as columns only the first n left
+        // singular vectors are formed
+        char jobz = m >= n ? 'S' : 'A';
+        FlatMatrix<float,ColMajor> Af(m,n,lh), Uf(m,jobz == 'S' ? k : m,lh), Vf(n,n,lh);
+        for(int i=0;i<m;i++)
+            for(int j=0;j<n;j++)
+                Af(i,j) = A(i,j);
+        FlatVector<float> sf(k,lh);
+        FlatArray<ngbla::integer> iwork(8*k,lh);
+        ngbla::integer info;
+        ngbla::integer lda = m, ldu = m, ldv = n;
+
+        thread_local WorkSizeTable worksizes;
+        LapackWorkSize ws = GetWorkSize(worksizes, m, n, [&] ()
+        {
+            float optwork;
+            ngbla::integer lwork = -1;
+            sgesdd_ ( &jobz, &m, &n, Af.Data(), &lda, sf.Data(),
+                     Uf.Data(), &ldu, Vf.Data(), &ldv,
+                     &optwork, &lwork, iwork.Data(), &info);
+            LapackWorkSize res;
+            res.lwork = ngbla::integer(optwork);
+            return res;
+        });
+        FlatArray<float> work(ws.lwork,lh);
+        ngbla::integer lwork = ws.lwork;
+        sgesdd_ ( &jobz, &m, &n, Af.Data(), &lda, sf.Data(),
+                 Uf.Data(), &ldu, Vf.Data(), &ldv,
+                 work.Data(), &lwork, iwork.Data(), &info);
+        if(info!=0 || sf(0) == 0)
+            return false;
+
+        // the first r singular vectors span the range, the others are refined
+        const double smax = sf(0);
+        const double tolf = 10 * n * std::numeric_limits<float>::epsilon() * smax;
+        const double threshold = max(max(eps, releps*smax), tolf);
+        int r = 0;
+        while(r < k && sf(r) > threshold) r++;
+        r = max(0, min(r, int(n) - tndof));
+        const int c = n - r;
+        int nzero = n - k;
+        for(int i=0;i<k;i++) if(sf(i) <= tolf) nzero++;
+
+        FlatMatrix<double,ColMajor> Z(n,c,lh), Ur(m,r,lh);
+        FlatMatrix<double> Vr(r,n,lh);
+        for(int j=0;j<c;j++)
+            for(int l=0;l<n;l++)
+                Z(l,j) = Vf(r+j,l);
+        for(int i=0;i<r;i++)
+        {
+            for(int l=0;l<m;l++) Ur(l,i) = Uf(l,i) / sf(i);
+            for(int l=0;l<n;l++) Vr(i,l) = Vf(i,l);
+        }
+
+        // Newton step Z -= Vr Sr^-1 Ur^T A Z, residual in double
+        FlatMatrix<double,ColMajor> AZ(m,c,lh);
+        FlatMatrix<double> T(r,c,lh);
+        AZ = A * Z;
+        T = Trans(Ur) * AZ;
+        Z -= Trans(Vr) * T;
+        for(int j=0;j<c;j++)
+        {
+            for(int i=0;i<j;i++)
+                Z.Col(j) -= InnerProduct(Z.Col(i),Z.Col(j)) * Z.Col(i);
+            Z.Col(j) /= L2Norm(Z.Col(j));
+        }
+
+        // Rayleigh-Ritz from the SVD of A*Z, the Gram matrix Z^T A^T A Z
+        // would only resolve singular values above sqrt(eps)*|A|
+        AZ = A * Z;
+        FlatMatrix<double,ColMajor> W(c,c,lh), ZW(n,c,lh);
+        FlatVector<double> sz(c,lh);
+        GetSVDRight<double>(AZ,sz,W,lh);
+        int nrefined = 0;
+        for(int j=0;j<c;j++)
+            if(sz(j) <= 1e-12 * smax) nrefined++;
+        if(nrefined < nzero)
+            return false;
+        ZW = Z * Trans(W);
+
+        for(int i=0;i<r;i++)
+            for(int l=0;l<n;l++)
+                V(i,l) = Vf(i,l);
+        for(int j=0;j<c;j++)
+            V.Row(r+j) = ZW.Col(j);
+        A = 0.0;
+        for(int i=0;i<r;i++)
+            A(i,i) = sf(i);
+        for(int i=r;i<k;i++)
+            A(i,i) = sz(i-r);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /*
+       One-sided (Hestenes) Jacobi SVD of up to SIMD<double>::Size() matrices
+       of equal size, one matrix per SIMD lane, rotated in lockstep until the
+       columns of all matrices are orthogonal. Same output as GetSVD: the
+       singular values (descending) on the diagonal of A, U and V (=V^T).
+       Only the first min(m,n) columns of U are computed, and only if U has
+       nonzero width. Lanes that are not converged after the sweep limit
+       fall back to GetSVD.
+    */
+    void BatchedJacobiSVD (FlatArray<FlatMatrix<double>> A,
+                           FlatArray<FlatMatrix<double,ColMajor>> U,
+                           FlatArray<FlatMatrix<double,ColMajor>> V,
+                           LocalHeap & lh)
+    {
+        static Timer t("BatchedJacobiSVD"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        constexpr size_t W = SIMD<double>::Size();
+        const size_t nb = A.Size();
+        const size_t m = A[0].Height(), n = A[0].Width();
+        const double tol = 10 * max(m,size_t(1)) * std::numeric_limits<double>::epsilon();
+
+        // the columns of the matrices, unused lanes repeat the last matrix
+        FlatMatrix<SIMD<double>> At(n,m,lh), Vt(n,n,lh);
+        double lanes[W];
+        for(size_t i=0;i<n;i++)
+            for(size_t j=0;j<m;j++)
+            {
+                for(size_t l=0;l<W;l++)
+                    lanes[l] = A[min(l,nb-1)](j,i);
+                At(i,j) = SIMD<double>(&lanes[0]);
+            }
+        for(size_t i=0;i<n;i++)
+            for(size_t j=0;j<n;j++)
+                Vt(i,j) = SIMD<double>(i==j ? 1.0 : 0.0);
+
+        // off-diagonal measure of every lane in the last sweep
+        SIMD<double> offlanes(0.0);
+        for(int sweep=0;sweep<60;sweep++)
+        {
+            double offmax = 0;
+            offlanes = SIMD<double>(0.0);
+            for(size_t p=0;p+1<n;p++)
+                for(size_t q=p+1;q<n;q++)
+                {
+                    SIMD<double> alpha(0.0), beta(0.0), gamma(0.0);
+                    for(size_t k=0;k<m;k++)
+                    {
+                        alpha += At(p,k)*At(p,k);
+                        beta += At(q,k)*At(q,k);
+                        gamma += At(p,k)*At(q,k);
+                    }
+                    SIMD<double> off = fabs(gamma) / (sqrt(alpha*beta) + SIMD<double>(1e-300));
+                    double pairmax = 0;
+                    for(size_t l=0;l<W;l++)
+                        pairmax = max(pairmax, off[l]);
+                    offmax = max(offmax, pairmax);
+                    offlanes = If(off > offlanes, off, offlanes);
+                    if(pairmax <= tol)
+                        continue;
+
+                    auto rot = off > SIMD<double>(tol);
+                    SIMD<double> one(1.0);
+                    SIMD<double> zeta = (beta-alpha) / (2.0*If(rot, gamma, one));
+                    SIMD<double> sign = If(zeta >= SIMD<double>(0.0), one, SIMD<double>(-1.0));
+                    SIMD<double> tn = sign / (fabs(zeta) + sqrt(one+zeta*zeta));
+                    SIMD<double> c = If(rot, one/sqrt(one+tn*tn), one);
+                    SIMD<double> s = If(rot, c*tn, SIMD<double>(0.0));
+                    for(size_t k=0;k<m;k++)
+                    {
+                        SIMD<double> ap = At(p,k), aq = At(q,k);
+                        At(p,k) = c*ap - s*aq;
+                        At(q,k) = s*ap + c*aq;
+                    }
+                    for(size_t k=0;k<n;k++)
+                    {
+                        SIMD<double> vp = Vt(p,k), vq = Vt(q,k);
+                        Vt(p,k) = c*vp - s*vq;
+                        Vt(q,k) = s*vp + c*vq;
+                    }
+                }
+            if(offmax <= tol)
+                break;
+        }
+
+        // singular values are the norms of the rotated columns
+        const size_t k = min(m,n);
+        FlatVector<double> sigma(n,lh);
+        FlatArray<int> order(n,lh);
+        for(size_t l=0;l<nb;l++)
+        {
+            if(offlanes[l] > tol)
+            {
+                HeapReset hrl(lh);
+                FlatMatrix<double,ColMajor> Ul(m, m, lh);
+                GetSVD<double>(A[l], U[l].Width() ? SliceMatrix<double,ColMajor>(U[l]) : SliceMatrix<double,ColMajor>(Ul), V[l], lh);
+                continue;
+            }
+            for(size_t i=0;i<n;i++)
+            {
+                double sum = 0;
+                for(size_t j=0;j<m;j++)
+                    sum += At(i,j)[l]*At(i,j)[l];
+                sigma(i) = sqrt(sum);
+                order[i] = i;
+            }
+            std::sort(order.Data(), order.Data()+n, [&] (int i, int j) { return sigma(i) > sigma(j); });
+
+            for(size_t i=0;i<n;i++)
+                for(size_t j=0;j<n;j++)
+                    V[l](i,j) = Vt(order[i],j)[l];
+            if(U[l].Width())
+            {
+                U[l] = 0.0;
+                for(size_t i=0;i<k;i++)
+                    if(sigma(order[i]) > 0)
+                        for(size_t j=0;j<m;j++)
+                            U[l](j,i) = At(order[i],j)[l] / sigma(order[i]);
+            }
+            A[l] = 0.0;
+            for(size_t i=0;i<k;i++)
+                A[l](i,i) = sigma(order[i]);
+        }
+    }
+
+    template
+    void GetSVD<double>
+        (SliceMatrix<double> A, SliceMatrix<double, ColMajor> U, SliceMatrix<double, ColMajor> V, LocalHeap & lh);
+
+    template
+    void GetSVD<Complex>
+        (SliceMatrix<Complex> A, SliceMatrix<Complex, ColMajor> U, SliceMatrix<Complex, ColMajor> V, LocalHeap & lh);
+
+    template
+    void GetSVDFromGram<double>
+        (SliceMatrix<double> A, SliceMatrix<double, ColMajor> U, SliceMatrix<double, ColMajor> V, LocalHeap & lh);
+
+    template
+    void GetSVDFromGram<Complex>
+        (SliceMatrix<Complex> A, SliceMatrix<Complex, ColMajor> U, SliceMatrix<Complex, ColMajor> V, LocalHeap & lh);
+
+    template
+    void GetSVDHermitian<double>
+        (SliceMatrix<double> A, SliceMatrix<double, ColMajor> U, SliceMatrix<double, ColMajor> V, LocalHeap & lh);
+
+    template
+    void GetSVDHermitian<Complex>
+        (SliceMatrix<Complex> A, SliceMatrix<Complex, ColMajor> U, SliceMatrix<Complex, ColMajor> V, LocalHeap & lh);
+
+    template
+    bool GetNullSpace<double>
+        (SliceMatrix<double> A, int nz, double eps, SliceMatrix<double, ColMajor> V, LocalHeap & lh);
+
+    template
+    bool GetNullSpace<Complex>
+        (SliceMatrix<Complex> A, int nz, double eps, SliceMatrix<Complex, ColMajor> V, LocalHeap & lh);
+}
+
+
+namespace ngcomp
+{
+
+    inline void HashCombine (size_t & seed, double val)
+    {
+        // round to a relative precision of 1e-8, entries are normalized to [-1,1]
+        size_t h = std::hash<long long>()(llround(val * 1e8));
+        seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+
+    inline void HashCombine (size_t & seed, Complex val)
+    {
+        HashCombine(seed, val.real());
+        HashCombine(seed, val.imag());
+    }
+
+    // 64 bit FNV-1a hash, stable across runs and machines with the same endianness
+    class StableHash
+    {
+        uint64_t h = 14695981039346656037ull;
+      public:
+        void Add (const void * p, size_t n)
+        {
+            auto bytes = static_cast<const unsigned char*>(p);
+            for (size_t i = 0; i < n; i++)
+            {
+                h ^= bytes[i];
+                h *= 1099511628211ull;
+            }
+        }
+        template <typename T>
+        void Add (T val)
+        {
+            static_assert(std::is_arithmetic<T>::value, "StableHash: arithmetic types only");
+            Add(&val, sizeof(T));
+        }
+        void Add (const string & s)
+        {
+            Add(s.size());
+            Add(s.data(), s.size());
+        }
+        string Hex () const
+        {
+            stringstream str;
+            str << std::hex << std::setw(16) << std::setfill('0') << h;
+            return str.str();
+        }
+    };
+
+    template <int D>
+    void HashPoints (StableHash & hash, const MeshAccess & ma)
+    {
+        for (size_t v = 0; v < ma.GetNV(); v++)
+        {
+            auto p = ma.GetPoint<D>(v);
+            for (int k = 0; k < D; k++)
+                hash.Add(double(p(k)));
+        }
+    }
+
+    /*
+       Key of an embedding in the cache directory: vertices and elements of
+       the mesh, the integrands of bf with the values of their GridFunction
+       and Parameter coefficients, their regions, integration order and
+       deformation, the flags and dofs of the spaces and the parameters of
+       the local decomposition. Curving of the mesh and user defined
+       integration rules are not part of the key.
+    */
+    template <class SCAL>
+    string EmbeddingKey (shared_ptr<SumOfIntegrals> bf, shared_ptr<FESpace> fes, shared_ptr<FESpace> test_fes,
+                         bool mixed_mode, double eps, int tndof, string method,
+                         double releps, bool equilibrate)
+    {
+        static Timer t("EmbeddingKey"); RegionTimer reg(t);
+        StableHash hash;
+        hash.Add(sizeof(SCAL));
+        hash.Add(eps);
+        hash.Add(releps);
+        hash.Add(equilibrate);
+        hash.Add(tndof);
+        hash.Add(method);
+
+        auto ma = fes->GetMeshAccess();
+        hash.Add(ma->GetDimension());
+        hash.Add(ma->GetNV());
+        switch (ma->GetDimension())
+        {
+            case 1: HashPoints<1>(hash, *ma); break;
+            case 2: HashPoints<2>(hash, *ma); break;
+            case 3: HashPoints<3>(hash, *ma); break;
+        }
+        for (VorB vb : { VOL, BND })
+            for (auto el : ma->Elements(vb))
+            {
+                hash.Add(el.GetIndex());
+                for (auto v : el.Vertices())
+                    hash.Add(int(v));
+            }
+
+        for (auto icf : bf->icfs)
+        {
+            stringstream str;
+            str << *icf->cf;
+            hash.Add(str.str());
+            // values which do not show up in the printed expression
+            icf->cf->TraverseTree ([&] (CoefficientFunction & nodecf)
+            {
+                if (auto gf = dynamic_cast<GridFunction*> (&nodecf))
+                {
+                    auto fv = gf->GetVector().FVDouble();
+                    hash.Add(fv.Data(), fv.Size()*sizeof(double));
+                }
+                else if (auto par = dynamic_cast<ParameterCoefficientFunction<double>*> (&nodecf))
+                    hash.Add(par->GetValue());
+            });
+            hash.Add(int(icf->dx.vb));
+            hash.Add(int(icf->dx.element_vb));
+            hash.Add(icf->dx.skeleton);
+            hash.Add(icf->dx.definedon.has_value());
+            if (icf->dx.definedon)
+            {
+                if (auto regions = get_if<BitArray>(&*icf->dx.definedon))
+                    for (size_t i = 0; i < regions->Size(); i++)
+                        hash.Add(regions->Test(i));
+                else
+                    hash.Add(get<string>(*icf->dx.definedon));
+            }
+            hash.Add(icf->dx.bonus_intorder);
+            hash.Add(bool(icf->dx.deformation));
+            if (icf->dx.deformation)
+            {
+                auto fv = icf->dx.deformation->GetVector().FVDouble();
+                hash.Add(fv.Data(), fv.Size()*sizeof(double));
+            }
+            if (icf->dx.definedonelements)
+                for (size_t i = 0; i < icf->dx.definedonelements->Size(); i++)
+                    hash.Add(icf->dx.definedonelements->Test(i));
+        }
+
+        Array<DofId> dnums;
+        for (auto space : { fes, test_fes })
+        {
+            hash.Add(space->GetClassName());
+            stringstream flags;
+            flags << space->GetFlags();
+            hash.Add(flags.str());
+            hash.Add(space->GetNDof());
+            for (size_t elnr = 0; elnr < ma->GetNE(VOL); elnr++)
+            {
+                space->GetDofNrs(ElementId(VOL,elnr), dnums);
+                hash.Add(dnums.Size());
+                hash.Add(dnums.Data(), dnums.Size()*sizeof(DofId));
+            }
+        }
+        hash.Add(mixed_mode);
+        return hash.Hex();
+    }
+
+    /*
+       Files of the cache directory are written under a temporary name
+       unique to the process and renamed, so concurrent runs with the same
+       key never read or overwrite a partial file.
+    */
+    template <class SCAL>
+    void SaveToCache (const EmbeddingMatrix<SCAL> & mat, string filename)
+    {
+#ifndef WIN32
+        long pid = getpid();
+#else
+        long pid = _getpid();
+#endif
+        std::random_device rd;
+        stringstream tmpname;
+        tmpname << filename << "." << pid << "." << std::hex << rd() << rd() << ".tmp";
+        mat.Save(tmpname.str());
+        std::filesystem::rename(tmpname.str(), filename);
+    }
+
+    enum SVD_METHOD { SVD_FULL, SVD_GRAM, SVD_JACOBI, SVD_LOBPCG, SVD_HERMITIAN, SVD_MIXED };
+
+    inline SVD_METHOD GetSVDMethod (string method)
+    {
+        if(method == "svd") return SVD_FULL;
+        if(method == "eig") return SVD_GRAM;
+        if(method == "jacobi") return SVD_JACOBI;
+        if(method == "lobpcg") return SVD_LOBPCG;
+        if(method == "hermitian") return SVD_HERMITIAN;
+        if(method == "mixed") return SVD_MIXED;
+        throw Exception("unknown method " + method + ", use svd, eig, jacobi, lobpcg, hermitian or mixed");
+    }
+
+    template <class SCAL>
+    void CalcElementSVD (SVD_METHOD method, SliceMatrix<SCAL> A,
+                         SliceMatrix<SCAL, ColMajor> U, SliceMatrix<SCAL, ColMajor> V,
+                         LocalHeap & lh)
+    {
+        switch(method)
+        {
+            case SVD_GRAM: ngbla::GetSVDFromGram<SCAL>(A,U,V,lh); break;
+            case SVD_HERMITIAN: ngbla::GetSVDHermitian<SCAL>(A,U,V,lh); break;
+            // single matrices gain nothing from the batched Jacobi kernel
+            default: ngbla::GetSVD<SCAL>(A,U,V,lh);
+        }
+    }
+
+    /*
+       Cache for the element SVDs in EmbTrefftz.
+       Element matrices are normalized by their largest entry, so that elements
+       whose matrices coincide up to a positive factor (e.g. translated or scaled
+       elements of a structured mesh and a constant coefficient operator)
+       share one entry. The singular vectors are reused, the singular values
+       are rescaled. At most maxentries matrices are cached, further element
+       matrices are decomposed without being stored.
+    */
+    template <class SCAL>
+    class SVDCache
+    {
+        struct Entry
+        {
+            ELEMENT_TYPE et;
+            Matrix<SCAL> elmat;  // normalized element matrix
+            Matrix<SCAL,ColMajor> U, Vt;
+            Vector<SCAL> sigma;  // singular values of the normalized element matrix
+        };
+
+        SVD_METHOD method;
+        mutex cachemutex;
+        std::unordered_multimap<size_t,Entry> entries;
+        const double tol = 1e-12;
+        static constexpr size_t maxentries = 1024;
+
+        public:
+        SVDCache (SVD_METHOD amethod) : method(amethod) {;}
+
+        void GetSVD (ELEMENT_TYPE et, SliceMatrix<SCAL> elmat,
+                     SliceMatrix<SCAL, ColMajor> U, SliceMatrix<SCAL, ColMajor> Vt,
+                     LocalHeap & lh)
+        {
+            static Timer t("SVDCache"); RegionTimer reg(t);
+            HeapReset hr(lh);
+            const size_t h = elmat.Height(), w = elmat.Width();
+
+            double scale = 0;
+            for(size_t i=0;i<h;i++)
+                for(size_t j=0;j<w;j++)
+                    scale = max(scale, abs(elmat(i,j)));
+            if(scale == 0)
+            {
+                CalcElementSVD<SCAL>(method,elmat,U,Vt,lh);
+                return;
+            }
+
+            FlatMatrix<SCAL> normmat(h,w,lh);
+            size_t key = et;
+            HashCombine(key, double(h));
+            HashCombine(key, double(w));
+            for(size_t i=0;i<h;i++)
+                for(size_t j=0;j<w;j++)
+                {
+                    normmat(i,j) = elmat(i,j) / scale;
+                    HashCombine(key, normmat(i,j));
+                }
+
+            {
+                lock_guard<mutex> lock(cachemutex);
+                auto range = entries.equal_range(key);
+                for(auto it = range.first; it != range.second; it++)
+                {
+                    const Entry & entry = it->second;
+                    if(entry.et != et || entry.elmat.Height() != h || entry.elmat.Width() != w)
+                        continue;
+                    bool match = true;
+                    for(size_t i=0;i<h && match;i++)
+                        for(size_t j=0;j<w && match;j++)
+                            match = abs(entry.elmat(i,j) - normmat(i,j)) <= tol;
+                    if(!match) continue;
+
+                    U = entry.U;
+                    Vt = entry.Vt;
+                    elmat = 0.0;
+                    for(size_t i=0;i<entry.sigma.Size();i++)
+                        elmat(i,i) = scale * entry.sigma(i);
+                    return;
+                }
+            }
+
+            CalcElementSVD<SCAL>(method,elmat,U,Vt,lh);
+            {
+                lock_guard<mutex> lock(cachemutex);
+                if(entries.size() >= maxentries)
+                    return;
+            }
+
+            Entry entry;
+            entry.et = et;
+            entry.elmat.SetSize(h,w);
+            entry.elmat = normmat;
+            entry.U.SetSize(U.Height(),U.Width());
+            entry.U = U;
+            entry.Vt.SetSize(Vt.Height(),Vt.Width());
+            entry.Vt = Vt;
+            entry.sigma.SetSize(min(h,w));
+            for(size_t i=0;i<entry.sigma.Size();i++)
+                entry.sigma(i) = elmat(i,i) / scale;
+
+            lock_guard<mutex> lock(cachemutex);
+            if(entries.size() < maxentries)
+                entries.emplace(key, std::move(entry));
+        }
+    };
+
+
+    /*
+       Read-only view of a file. The pages are mapped copy-on-write, so
+       the blocks can be used (and modified) without reading the file.
+    */
+    class MappedFile
+    {
+        char * ptr = nullptr;
+        size_t size = 0;
+#ifdef WIN32
+        Array<char> buffer;
+#endif
+      public:
+        MappedFile (string filename)
+        {
+#ifdef WIN32
+            ifstream in(filename, ios::binary | ios::ate);
+            if (!in)
+                throw Exception("cannot open embedding file " + filename);
+            size = in.tellg();
+            buffer.SetSize(size);
+            in.seekg(0);
+            in.read(buffer.Data(), size);
+            ptr = buffer.Data();
+#else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw Exception("cannot open embedding file " + filename);
+            struct stat st;
+            if (fstat(fd, &st) != 0)
+            {
+                close(fd);
+                throw Exception("cannot stat embedding file " + filename);
+            }
+            size = st.st_size;
+            void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                throw Exception("cannot map embedding file " + filename);
+            ptr = static_cast<char*>(p);
+#endif
+        }
+        ~MappedFile ()
+        {
+#ifndef WIN32
+            munmap(ptr, size);
+#endif
+        }
+        char * Data () const { return ptr; }
+        size_t Size () const { return size; }
+    };
+
+    struct EmbeddingFileHeader
+    {
+        char magic[8];
+        uint64_t scalsize, height, width, nblocks, nvalues, haslf, nrowdofs;
+    };
+    static const char embedding_magic[8] = "NGSTEMB";
+
+    static EmbeddingFileHeader ReadEmbeddingHeader (const MappedFile & file)
+    {
+        EmbeddingFileHeader header;
+        if (file.Size() < sizeof(header))
+            throw Exception("not an embedding file");
+        memcpy(&header, file.Data(), sizeof(header));
+        if (memcmp(header.magic, embedding_magic, sizeof(embedding_magic)) != 0)
+            throw Exception("not an embedding file");
+        return header;
+    }
+
+    template <class SCAL>
+    EmbeddingWriter<SCAL> :: EmbeddingWriter (string afilename, size_t aheight)
+        : filename(afilename), out(afilename, ios::binary), height(aheight)
+    {
+        if (!out)
+            throw Exception("cannot write embedding file " + filename);
+        EmbeddingFileHeader header{};  // written again by Finish
+        out.write(reinterpret_cast<char*>(&header), sizeof(header));
+    }
+
+    template <class SCAL>
+    void EmbeddingWriter<SCAL> :: WriteBlocks (FlatArray<SCAL> blockvalues)
+    {
+        out.write(reinterpret_cast<const char*>(blockvalues.Data()), blockvalues.Size()*sizeof(SCAL));
+        nvalues += blockvalues.Size();
+    }
+
+    template <class SCAL>
+    void EmbeddingWriter<SCAL> :: Finish (FlatArray<int> ncols, const Table<int> & rowdofs, const SCAL * lfvec)
+    {
+        const size_t nb = ncols.Size();
+        EmbeddingFileHeader header;
+        memcpy(header.magic, embedding_magic, sizeof(embedding_magic));
+        header.scalsize = sizeof(SCAL);
+        header.height = height;
+        header.width = 0;
+        for (int nc : ncols)
+            header.width += nc;
+        header.nblocks = nb;
+        header.nvalues = nvalues;
+        header.haslf = lfvec != nullptr;
+        header.nrowdofs = rowdofs.AsArray().Size();
+
+        if (lfvec)
+            out.write(reinterpret_cast<const char*>(lfvec), height*sizeof(SCAL));
+        Array<int> rowsize(nb);
+        for (size_t i = 0; i < nb; i++)
+            rowsize[i] = rowdofs[i].Size();
+        out.write(reinterpret_cast<const char*>(ncols.Data()), nb*sizeof(int));
+        out.write(reinterpret_cast<const char*>(rowsize.Data()), nb*sizeof(int));
+        out.write(reinterpret_cast<const char*>(rowdofs.AsArray().Data()), header.nrowdofs*sizeof(int));
+
+        out.seekp(0);
+        out.write(reinterpret_cast<char*>(&header), sizeof(header));
+        out.close();
+        if (!out)
+            throw Exception("writing embedding file " + filename + " failed");
+    }
+
+    template class EmbeddingWriter<double>;
+    template class EmbeddingWriter<Complex>;
+
+
+    template <class SCAL>
+    EmbeddingMatrix<SCAL> :: EmbeddingMatrix (size_t aheight, Table<int> && arowdofs, FlatArray<int> ncols)
+        : height(aheight), rowdofs(std::move(arowdofs))
+    {
+        Setup(ncols);
+        values.SetSize(firstval[rowdofs.Size()]);
+        data = values.Data();
+    }
+
+    template <class SCAL>
+    EmbeddingMatrix<SCAL> :: EmbeddingMatrix (string filename)
+    {
+        static Timer t("EmbeddingMatrix::Load"); RegionTimer reg(t);
+        mapping = make_shared<MappedFile>(filename);
+        auto header = ReadEmbeddingHeader(*mapping);
+        if (header.scalsize != sizeof(SCAL))
+            throw Exception("embedding file " + filename + " has a different scalar type");
+        const size_t nb = header.nblocks;
+        size_t expected = sizeof(header) + (header.nvalues + header.haslf*header.height)*sizeof(SCAL)
+                          + (2*nb + header.nrowdofs)*sizeof(int);
+        if (mapping->Size() != expected)
+            throw Exception("embedding file " + filename + " is truncated");
+
+        char * ptr = mapping->Data() + sizeof(header);
+        data = reinterpret_cast<SCAL*>(ptr);
+        ptr += header.nvalues*sizeof(SCAL);
+        if (header.haslf)
+        {
+            lfdata = reinterpret_cast<SCAL*>(ptr);
+            ptr += header.height*sizeof(SCAL);
+        }
+        FlatArray<int> ncols(nb, reinterpret_cast<int*>(ptr));
+        FlatArray<int> rowsize(nb, reinterpret_cast<int*>(ptr)+nb);
+        FlatArray<int> dofs(header.nrowdofs, reinterpret_cast<int*>(ptr)+2*nb);
+
+        // the sizes are checked before they are used, a corrupt file of the
+        // right size must not write out of bounds
+        size_t nrowdofs = 0;
+        for (size_t i = 0; i < nb; i++)
+        {
+            if (ncols[i] < 0 || rowsize[i] < 0)
+                throw Exception("embedding file " + filename + " is inconsistent");
+            nrowdofs += rowsize[i];
+        }
+        if (nrowdofs != header.nrowdofs)
+            throw Exception("embedding file " + filename + " is inconsistent");
+        for (int d : dofs)
+            if (d < 0 || size_t(d) >= header.height)
+                throw Exception("embedding file " + filename + " is inconsistent");
+
+        height = header.height;
+        rowdofs = Table<int>(rowsize);
+        rowdofs.AsArray() = dofs;
+        Setup(ncols);
+        if (firstval[nb] != header.nvalues)
+            throw Exception("embedding file " + filename + " is inconsistent");
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: Setup (FlatArray<int> ncols)
+    {
+        const size_t nb = rowdofs.Size();
+        firstcol.SetSize(nb+1);
+        firstval.SetSize(nb+1);
+        firstcol[0] = 0;
+        firstval[0] = 0;
+        for (size_t i = 0; i < nb; i++)
+        {
+            firstcol[i+1] = firstcol[i] + ncols[i];
+            firstval[i+1] = firstval[i] + ncols[i]*rowdofs[i].Size();
+        }
+        width = firstcol[nb];
+
+        Array<int> cnt(height);
+        cnt = 0;
+        for (size_t i = 0; i < nb; i++)
+            for (int d : rowdofs[i])
+                if (cnt[d]++) overlap = true;
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: Save (string filename, shared_ptr<BaseVector> lfvec) const
+    {
+        static Timer t("EmbeddingMatrix::Save"); RegionTimer reg(t);
+        const size_t nb = GetNBlocks();
+        Array<int> ncols(nb);
+        for (size_t i = 0; i < nb; i++)
+            ncols[i] = GetCols(i).Size();
+        EmbeddingWriter<SCAL> writer(filename, height);
+        writer.WriteBlocks(FlatArray<SCAL>(firstval[nb], data));
+        writer.Finish(ncols, rowdofs, lfvec ? lfvec->FV<SCAL>().Data() : lfdata);
+    }
+
+    template <class SCAL>
+    shared_ptr<BaseVector> EmbeddingMatrix<SCAL> :: GetParticularSolution () const
+    {
+        if (!lfdata)
+            return nullptr;
+        auto lfvec = make_shared<VVector<SCAL>>(height);
+        lfvec->FV() = FlatVector<SCAL>(height, lfdata);
+        return lfvec;
+    }
+
+    shared_ptr<BaseMatrix> LoadEmbedding (string filename)
+    {
+        EmbeddingFileHeader header = ReadEmbeddingHeader(MappedFile(filename));
+        if (header.scalsize == sizeof(Complex))
+            return make_shared<EmbeddingMatrix<Complex>>(filename);
+        return make_shared<EmbeddingMatrix<double>>(filename);
+    }
+
+    template <class SCAL> template <class TS>
+    void EmbeddingMatrix<SCAL> :: MultAddImpl (TS s, const BaseVector & x, BaseVector & y) const
+    {
+        static Timer t("EmbeddingMatrix::MultAdd"); RegionTimer reg(t);
+        auto fx = x.FV<SCAL>();
+        auto fy = y.FV<SCAL>();
+        auto multblock = [&] (size_t i)
+        {
+            FlatMatrix<SCAL> block = GetBlock(i);
+            FlatArray<int> rows = rowdofs[i];
+            FlatVector<SCAL> xi = fx.Range(GetCols(i));
+            VectorMem<100,SCAL> yr(rows.Size());
+            yr = block * xi;
+            for (size_t r = 0; r < rows.Size(); r++)
+                fy(rows[r]) += s * yr(r);
+        };
+        if (overlap)
+            for (size_t i = 0; i < GetNBlocks(); i++) multblock(i);
+        else
+            ParallelFor (GetNBlocks(), multblock);
+    }
+
+    template <class SCAL> template <class TS>
+    void EmbeddingMatrix<SCAL> :: MultTransAddImpl (TS s, const BaseVector & x, BaseVector & y) const
+    {
+        static Timer t("EmbeddingMatrix::MultTransAdd"); RegionTimer reg(t);
+        auto fx = x.FV<SCAL>();
+        auto fy = y.FV<SCAL>();
+        // the columns of the blocks are disjoint
+        ParallelFor (GetNBlocks(), [&] (size_t i)
+        {
+            FlatMatrix<SCAL> block = GetBlock(i);
+            FlatArray<int> rows = rowdofs[i];
+            FlatVector<SCAL> yi = fy.Range(GetCols(i));
+            VectorMem<100,SCAL> xr(rows.Size());
+            for (size_t r = 0; r < rows.Size(); r++)
+                xr(r) = fx(rows[r]);
+            yi += s * (Trans(block) * xr);
+        });
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: Mult (const BaseVector & x, BaseVector & y) const
+    {
+        y = 0.0;
+        MultAddImpl(1.0, x, y);
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: MultAdd (double s, const BaseVector & x, BaseVector & y) const
+    {
+        MultAddImpl(s, x, y);
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: MultAdd (Complex s, const BaseVector & x, BaseVector & y) const
+    {
+        if constexpr (is_same<SCAL,Complex>::value)
+            MultAddImpl(s, x, y);
+        else
+            BaseMatrix::MultAdd(s, x, y);
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: MultTrans (const BaseVector & x, BaseVector & y) const
+    {
+        y = 0.0;
+        MultTransAddImpl(1.0, x, y);
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: MultTransAdd (double s, const BaseVector & x, BaseVector & y) const
+    {
+        MultTransAddImpl(s, x, y);
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: MultTransAdd (Complex s, const BaseVector & x, BaseVector & y) const
+    {
+        if constexpr (is_same<SCAL,Complex>::value)
+            MultTransAddImpl(s, x, y);
+        else
+            BaseMatrix::MultTransAdd(s, x, y);
+    }
+
+    template <class SCAL>
+    shared_ptr<SparseMatrix<SCAL>> EmbeddingMatrix<SCAL> :: CreateSparseMatrix () const
+    {
+        static Timer t("EmbeddingMatrix::CreateSparseMatrix"); RegionTimer reg(t);
+        const size_t nb = GetNBlocks();
+        Table<int> coldofs = ColTable();
+
+        auto P = make_shared<SparseMatrix<SCAL>>(height, width, rowdofs, coldofs, false);
+        P->SetZero();
+        auto addblock = [&] (size_t i)
+        {
+            if (coldofs[i].Size())
+                P->AddElementMatrix(rowdofs[i], coldofs[i], GetBlock(i));
+        };
+        if (overlap)
+            for (size_t i = 0; i < nb; i++) addblock(i);
+        else
+            ParallelFor (nb, addblock);
+        return P;
+    }
+
+    template <class SCAL>
+    Table<int> EmbeddingMatrix<SCAL> :: ColTable () const
+    {
+        const size_t nb = GetNBlocks();
+        Array<int> ncols(nb);
+        for (size_t i = 0; i < nb; i++)
+            ncols[i] = GetCols(i).Size();
+        Table<int> cols(ncols);
+        for (size_t i = 0; i < nb; i++)
+            for (int k = 0; k < ncols[i]; k++)
+                cols[i][k] = firstcol[i] + k;
+        return cols;
+    }
+
+    template <class SCAL>
+    void EmbeddingMatrix<SCAL> :: DofToBlock (FlatArray<int> dof2block, FlatArray<int> dof2loc) const
+    {
+        dof2block = -1;
+        ParallelFor (GetNBlocks(), [&] (size_t i)
+        {
+            for (size_t k = 0; k < rowdofs[i].Size(); k++)
+            {
+                dof2block[rowdofs[i][k]] = i;
+                dof2loc[rowdofs[i][k]] = k;
+            }
+        });
+    }
+
+    template <class SCAL>
+    shared_ptr<SparseMatrix<SCAL>> EmbeddingMatrix<SCAL> :: CreateGalerkinMatrix (const Table<int> & nbblocks,
+                                                                                const Table<int> & rowcols) const
+    {
+        const size_t nb = GetNBlocks();
+        Array<int> nnbcols(nb);
+        for (size_t i = 0; i < nb; i++)
+        {
+            nnbcols[i] = 0;
+            for (int j : nbblocks[i])
+                nnbcols[i] += GetCols(j).Size();
+        }
+        Table<int> nbcols(nnbcols);
+        ParallelFor (nb, [&] (size_t i)
+        {
+            int cnt = 0;
+            for (int j : nbblocks[i])
+                for (auto c : GetCols(j))
+                    nbcols[i][cnt++] = c;
+        });
+
+        auto PtAP = make_shared<SparseMatrix<SCAL>>(width, width, rowcols, nbcols, false);
+        PtAP->SetZero();
+        return PtAP;
+    }
+
+    template <class SCAL>
+    shared_ptr<SparseMatrix<SCAL>> EmbeddingMatrix<SCAL> :: GalerkinProduct (const SparseMatrix<SCAL> & A) const
+    {
+        static Timer t("EmbeddingMatrix::GalerkinProduct"); RegionTimer reg(t);
+        if (A.Height() != height || A.Width() != height)
+            throw Exception("GalerkinProduct: matrix does not fit the embedding");
+        if (dynamic_cast<const SparseMatrixSymmetric<SCAL>*>(&A))
+            throw Exception("GalerkinProduct: symmetric storage not supported, assemble without symmetric flag");
+        if (overlap)
+            throw Exception("GalerkinProduct: elements share dofs, use the sparse embedding instead");
+
+        const size_t nb = GetNBlocks();
+        Array<int> dof2block(height), dof2loc(height);
+        DofToBlock(dof2block, dof2loc);
+
+        // blocks coupled by A
+        TableCreator<int> creator(nb);
+        for ( ; !creator.Done(); creator++)
+            ParallelFor (nb, [&] (size_t i)
+            {
+                if (GetCols(i).Size() == 0) return;
+                ArrayMem<int,50> nbs;
+                for (int d : rowdofs[i])
+                    for (int c : A.GetRowIndices(d))
+                    {
+                        int j = dof2block[c];
+                        if (j >= 0 && GetCols(j).Size() && !nbs.Contains(j))
+                            nbs.Append(j);
+                    }
+                for (int j : nbs)
+                    creator.Add(i, j);
+            });
+        Table<int> nbblocks = creator.MoveTable();
+        Table<int> rowcols = ColTable();
+        auto PtAP = CreateGalerkinMatrix(nbblocks, rowcols);
+
+        LocalHeap glh(10*1000*1000, "galerkin product", true);
+        ParallelForRange (nb, [&] (IntRange r)
+        {
+            LocalHeap lh = glh.Split();
+            for (auto i : r)
+            {
+                if (rowcols[i].Size() == 0) continue;
+                HeapReset hr(lh);
+                FlatArray<int> rows = rowdofs[i];
+                FlatArray<int> nbs = nbblocks[i];
+
+                // couplings of the dofs of block i with the dofs of the neighbouring blocks
+                FlatArray<FlatMatrix<SCAL>> Aij(nbs.Size(), lh);
+                for (size_t l = 0; l < nbs.Size(); l++)
+                {
+                    Aij[l].AssignMemory(rows.Size(), rowdofs[nbs[l]].Size(), lh);
+                    Aij[l] = 0.0;
+                }
+                for (size_t k = 0; k < rows.Size(); k++)
+                {
+                    FlatArray<int> cols = A.GetRowIndices(rows[k]);
+                    FlatVector<SCAL> vals = A.GetRowValues(rows[k]);
+                    for (size_t l = 0; l < cols.Size(); l++)
+                    {
+                        int j = dof2block[cols[l]];
+                        if (j < 0 || GetCols(j).Size() == 0) continue;
+                        Aij[nbs.Pos(j)](k, dof2loc[cols[l]]) += vals(l);
+                    }
+                }
+
+                for (size_t l = 0; l < nbs.Size(); l++)
+                {
+                    HeapReset hr2(lh);
+                    FlatMatrix<SCAL> Pj = GetBlock(nbs[l]);
+                    FlatMatrix<SCAL> APj(rows.Size(), Pj.Width(), lh);
+                    APj = Aij[l] * Pj;
+                    FlatMatrix<SCAL> PtAPij(rowcols[i].Size(), Pj.Width(), lh);
+                    PtAPij = Trans(GetBlock(i)) * APj;
+                    PtAP->AddElementMatrix(rowcols[i], rowcols[nbs[l]], PtAPij);
+                }
+            }
+        });
+        return PtAP;
+    }
+
+    // surface element on each boundary facet, -1 for inner facets
+    static void FacetToSurfaceElement (const MeshAccess & ma, FlatArray<int> facet2sel)
+    {
+        facet2sel = -1;
+        for (size_t sel = 0; sel < ma.GetNSE(); sel++)
+            facet2sel[ma.GetElFacets(ElementId(BND,sel))[0]] = sel;
+    }
+
+    template <class SCAL>
+    shared_ptr<SparseMatrix<SCAL>> EmbeddingMatrix<SCAL> :: GalerkinProduct (shared_ptr<SumOfIntegrals> bf,
+                                                                           shared_ptr<FESpace> fes) const
+    {
+        static Timer t("EmbeddingMatrix::GalerkinProduct(bf)"); RegionTimer reg(t);
+        static Timer tvol("EmbeddingMatrix::GalerkinProduct(bf) - elements");
+        static Timer tfacet("EmbeddingMatrix::GalerkinProduct(bf) - inner facets");
+
+        auto ma = fes->GetMeshAccess();
+        if (fes->GetNDof() != height || ma->GetNE(VOL) != GetNBlocks())
+            throw Exception("GalerkinProduct: space does not fit the embedding");
+        if (overlap)
+            throw Exception("GalerkinProduct: elements share dofs, use the sparse embedding instead");
+
+        Array<shared_ptr<BilinearFormIntegrator>> bfis[4];  // VOL, BND, ...
+        Array<shared_ptr<FacetBilinearFormIntegrator>> facetbfis[4];  // inner facets, boundary facets
+        for (auto icf : bf->icfs)
+        {
+            auto bfi = icf->MakeBilinearFormIntegrator();
+            if (bfi->SkeletonForm())
+                facetbfis[bfi->VB()] += dynamic_pointer_cast<FacetBilinearFormIntegrator>(bfi);
+            else
+                bfis[bfi->VB()] += bfi;
+        }
+        if (bfis[BBND].Size() || bfis[BBBND].Size() || facetbfis[BBND].Size() || facetbfis[BBBND].Size())
+            throw Exception("GalerkinProduct: only integrals over elements and facets are supported");
+
+        const size_t nb = GetNBlocks();
+        Array<int> dof2block(height), dof2loc(height);
+        DofToBlock(dof2block, dof2loc);
+
+        Array<int> facet2sel(ma->GetNFacets());
+        facet2sel = -1;
+        if (bfis[BND].Size() || facetbfis[BND].Size())
+            FacetToSurfaceElement(*ma, facet2sel);
+
+        // blocks coupled through inner facets
+        TableCreator<int> creator(nb);
+        for ( ; !creator.Done(); creator++)
+            ParallelFor (nb, [&] (size_t i)
+            {
+                if (GetCols(i).Size() == 0) return;
+                creator.Add(i, i);
+                if (facetbfis[VOL].Size() == 0) return;
+                ArrayMem<int,2> elnums;
+                for (auto fnr : ma->GetElFacets(ElementId(VOL,i)))
+                {
+                    ma->GetFacetElements(fnr, elnums);
+                    for (int j : elnums)
+                        if (j != int(i) && GetCols(j).Size())
+                            creator.Add(i, j);
+                }
+            });
+        Table<int> nbblocks = creator.MoveTable();
+        Table<int> rowcols = ColTable();
+        auto PtAP = CreateGalerkinMatrix(nbblocks, rowcols);
+
+        // rows of block b for the local dofs dnums, zero for dofs outside the block
+        auto localblock = [&] (int b, FlatArray<DofId> dnums, SliceMatrix<SCAL> Pb)
+        {
+            FlatMatrix<SCAL> block = GetBlock(b);
+            for (size_t k = 0; k < dnums.Size(); k++)
+                if (IsRegularDof(dnums[k]) && dof2block[dnums[k]] == b)
+                    Pb.Row(k) = block.Row(dof2loc[dnums[k]]);
+                else
+                    Pb.Row(k) = 0.0;
+        };
+
+        // element, surface element and boundary facet terms only couple
+        // block i with itself, every task writes the rows of its own block
+        LocalHeap glh(100*1000*1000, "galerkin product", true);
+        {
+        RegionTimer regvol(tvol);
+        ParallelForRange (nb, [&] (IntRange r)
+        {
+            LocalHeap lh = glh.Split();
+            for (auto i : r)
+            {
+                const int nc = GetCols(i).Size();
+                if (nc == 0) continue;
+                HeapReset hr(lh);
+                ElementId ei(VOL, i);
+                auto & trafo = ma->GetTrafo(ei, lh);
+                auto & fel = fes->GetFE(ei, lh);
+                Array<DofId> dnums(fel.GetNDof(), lh);
+                fes->GetDofNrs(ei, dnums);
+
+                FlatMatrix<SCAL> elmat(dnums.Size(), dnums.Size(), lh);
+                elmat = 0.0;
+                bool symmetric_so_far = true;
+                int bfi_ind = 0;
+                while (bfi_ind < bfis[VOL].Size())
+                {
+                    auto & bfi = bfis[VOL][bfi_ind];
+                    bfi_ind++;
+                    if (!bfi->DefinedOn(ma->GetElIndex(ei)) || !bfi->DefinedOnElement(i)) continue;
+                    auto & mapped_trafo = trafo.AddDeformation(bfi->GetDeformation().get(), lh);
+                    try
+                    {
+                        bfi->CalcElementMatrixAdd(fel, mapped_trafo, elmat, symmetric_so_far, lh);
+                    }
+                    catch (ExceptionNOSIMD e)
+                    {
+                        elmat = 0.0;
+                        cout << IM(6) << "ExceptionNOSIMD " << e.What() << endl
+                        << "switching to scalar evaluation" << endl;
+                        bfi -> SetSimdEvaluate (false);
+                        bfi_ind = 0;
+                    }
+                }
+
+                FlatMatrix<SCAL> PtAPii(nc, nc, lh);
+                PtAPii = 0.0;
+                auto fnums = ma->GetElFacets(ei);
+                // facets are only visited for boundary terms
+                const size_t nfacets = (bfis[BND].Size() || facetbfis[BND].Size()) ? fnums.Size() : 0;
+                for (size_t facnr = 0; facnr < nfacets; facnr++)
+                {
+                    int sel = facet2sel[fnums[facnr]];
+                    if (sel < 0) continue;
+                    HeapReset hr2(lh);
+                    ElementId sei(BND, sel);
+                    auto & strafo = ma->GetTrafo(sei, lh);
+
+                    // boundary facet terms live on the dofs of the element
+                    auto vnums = ma->GetElVertices(ei);
+                    auto svnums = ma->GetElVertices(sei);
+                    FlatMatrix<SCAL> facetmat(dnums.Size(), dnums.Size(), lh);
+                    for (auto & bfi : facetbfis[BND])
+                    {
+                        if (!bfi->DefinedOn(ma->GetElIndex(sei))) continue;
+                        bfi->CalcFacetMatrix(fel, facnr, trafo, vnums, strafo, svnums, facetmat, lh);
+                        elmat += facetmat;
+                    }
+
+                    // surface element terms, their dofs belong to element i
+                    if (bfis[BND].Size() == 0) continue;
+                    auto & sfel = fes->GetFE(sei, lh);
+                    Array<DofId> sdnums(sfel.GetNDof(), lh);
+                    fes->GetDofNrs(sei, sdnums);
+                    if (sdnums.Size() == 0) continue;
+                    FlatMatrix<SCAL> selmat(sdnums.Size(), sdnums.Size(), lh);
+                    selmat = 0.0;
+                    int sbfi_ind = 0;
+                    while (sbfi_ind < bfis[BND].Size())
+                    {
+                        auto & bfi = bfis[BND][sbfi_ind];
+                        sbfi_ind++;
+                        if (!bfi->DefinedOn(ma->GetElIndex(sei)) || !bfi->DefinedOnElement(sel)) continue;
+                        try
+                        {
+                            bfi->CalcElementMatrixAdd(sfel, strafo, selmat, symmetric_so_far, lh);
+                        }
+                        catch (ExceptionNOSIMD e)
+                        {
+                            selmat = 0.0;
+                            cout << IM(6) << "ExceptionNOSIMD " << e.What() << endl
+                            << "switching to scalar evaluation" << endl;
+                            bfi -> SetSimdEvaluate (false);
+                            sbfi_ind = 0;
+                        }
+                    }
+                    FlatMatrix<SCAL> Ps(sdnums.Size(), nc, lh);
+                    localblock(i, sdnums, Ps);
+                    FlatMatrix<SCAL> APs(sdnums.Size(), nc, lh);
+                    APs = selmat * Ps;
+                    PtAPii += Trans(Ps) * APs;
+                }
+
+                FlatMatrix<SCAL> Pi(dnums.Size(), nc, lh);
+                localblock(i, dnums, Pi);
+                FlatMatrix<SCAL> APi(dnums.Size(), nc, lh);
+                APi = elmat * Pi;
+                PtAPii += Trans(Pi) * APi;
+                PtAP->AddElementMatrix(rowcols[i], rowcols[i], PtAPii);
+            }
+        });
+        }
 
-namespace ngbla{
+        if (facetbfis[VOL].Size() == 0)
+            return PtAP;
 
-#ifdef LAPACK
-    void LapackSVD (SliceMatrix<double, ColMajor> A,
-                    SliceMatrix<double, ColMajor> U,
-                    SliceMatrix<double, ColMajor> V)
+        // inner facets couple two blocks, each facet matrix is computed once
+        // and its rows are added under the lock of the receiving block
+        RegionTimer regfacet(tfacet);
+        Array<mutex> blocklocks(nb);
+        ParallelForRange (ma->GetNFacets(), [&] (IntRange r)
+        {
+            LocalHeap lh = glh.Split();
+            ArrayMem<int,2> elnums;
+            for (auto fnr : r)
+            {
+                ma->GetFacetElements(fnr, elnums);
+                if (elnums.Size() < 2) continue;
+                int e1 = elnums[0], e2 = elnums[1];
+                const int nc1 = GetCols(e1).Size(), nc2 = GetCols(e2).Size();
+                if (nc1 + nc2 == 0) continue;
+                HeapReset hr(lh);
+
+                ElementId ei1(VOL, e1), ei2(VOL, e2);
+                auto fnums1 = ma->GetElFacets(ei1);
+                auto fnums2 = ma->GetElFacets(ei2);
+                int facnr1 = fnums1.Pos(fnr);
+                int facnr2 = fnums2.Pos(fnr);
+                auto & trafo1 = ma->GetTrafo(ei1, lh);
+                auto & trafo2 = ma->GetTrafo(ei2, lh);
+                auto & fel1 = fes->GetFE(ei1, lh);
+                auto & fel2 = fes->GetFE(ei2, lh);
+                auto vnums1 = ma->GetElVertices(ei1);
+                auto vnums2 = ma->GetElVertices(ei2);
+
+                const size_t nd1 = fel1.GetNDof(), nd2 = fel2.GetNDof();
+                Array<DofId> dnums1(nd1, lh), dnums2(nd2, lh);
+                fes->GetDofNrs(ei1, dnums1);
+                fes->GetDofNrs(ei2, dnums2);
+                FlatArray<DofId> dnums(nd1+nd2, lh);
+                dnums.Range(0, nd1) = dnums1;
+                dnums.Range(nd1, nd1+nd2) = dnums2;
+
+                FlatMatrix<SCAL> elmat(nd1+nd2, nd1+nd2, lh);
+                FlatMatrix<SCAL> facetmat(nd1+nd2, nd1+nd2, lh);
+                elmat = 0.0;
+                for (auto & bfi : facetbfis[VOL])
+                {
+                    if (!bfi->DefinedOn(ma->GetElIndex(ei1)) || !bfi->DefinedOn(ma->GetElIndex(ei2))) continue;
+                    if (!bfi->DefinedOnElement(fnr)) continue;
+                    bfi->CalcFacetMatrix(fel1, facnr1, trafo1, vnums1,
+                                         fel2, facnr2, trafo2, vnums2, facetmat, lh);
+                    elmat += facetmat;
+                }
+
+                FlatMatrix<SCAL> P12(nd1+nd2, nc1+nc2, lh);
+                localblock(e1, dnums, P12.Cols(0, nc1));
+                localblock(e2, dnums, P12.Cols(nc1, nc1+nc2));
+                FlatMatrix<SCAL> AP12(nd1+nd2, nc1+nc2, lh);
+                AP12 = elmat * P12;
+                FlatMatrix<SCAL> PtAP12(nc1+nc2, nc1+nc2, lh);
+                PtAP12 = Trans(P12) * AP12;
+
+                FlatArray<int> cols(nc1+nc2, lh);
+                cols.Range(0, nc1) = rowcols[e1];
+                cols.Range(nc1, nc1+nc2) = rowcols[e2];
+                if (nc1)
+                {
+                    lock_guard<mutex> guard(blocklocks[e1]);
+                    PtAP->AddElementMatrix(rowcols[e1], cols, PtAP12.Rows(0, nc1));
+                }
+                if (nc2)
+                {
+                    lock_guard<mutex> guard(blocklocks[e2]);
+                    PtAP->AddElementMatrix(rowcols[e2], cols, PtAP12.Rows(nc1, nc1+nc2));
+                }
+            }
+        });
+        return PtAP;
+    }
+
+    template <class SCAL>
+    shared_ptr<BaseMatrix> EmbeddingMatrix<SCAL> :: CreateSchwarzPreconditioner (shared_ptr<SparseMatrix<SCAL>> PtAP,
+                                                                                 bool patches) const
     {
-        static Timer t("LapackSVD"); RegionTimer reg(t);
-        ngbla::integer n = A.Width(), m = A.Height();
-        Vector<> S(min(n,m));
-        Array<double> work(4*m*m+6*m+m+100);
-        Array<int> iwork(max(n,m)*9);
-        ngbla::integer info;
-        char jobz = 'A';
-        ngbla::integer lda = A.Dist(), ldu = U.Dist(), ldv = V.Dist();
-        ngbla::integer lwork = work.Size();
+        static Timer t("EmbeddingMatrix::CreateSchwarzPreconditioner"); RegionTimer reg(t);
+        if (PtAP->Height() != width || PtAP->Width() != width)
+            throw Exception("CreateSchwarzPreconditioner: matrix does not match the Trefftz dofs");
+        const size_t nb = GetNBlocks();
+        Array<int> col2block(width);
+        for (size_t i = 0; i < nb; i++)
+            col2block.Range(GetCols(i)) = i;
 
-        //if(std::is_same<SCAL,double>::value)
-        dgesdd_ ( &jobz, &m, &n, A.Data(), &lda,
-                 S.Data(),
-                 U.Data(), &ldu, V.Data(), &ldv,
-                 work.Data(), &lwork, iwork.Data(),
-                 &info);
-        if(info!=0)
-            throw Exception("something went wrong in the svd " + std::to_string(info));
-        A = 0.0;
-        A.Diag(0) = S;
+        // blocks j > i coupled with block i in PtAP (facet neighbours for DG)
+        TableCreator<int> creator(nb);
+        for ( ; !creator.Done(); creator++)
+            ParallelFor (nb, [&] (size_t i)
+            {
+                if (!patches || GetCols(i).Size() == 0) return;
+                ArrayMem<int,50> nbs;
+                for (int c : GetCols(i))
+                    for (int c2 : PtAP->GetRowIndices(c))
+                    {
+                        int j = col2block[c2];
+                        if (j > int(i) && !nbs.Contains(j))
+                            nbs.Append(j);
+                    }
+                for (int j : nbs)
+                    creator.Add(i, j);
+            });
+        Table<int> nbblocks = creator.MoveTable();
+
+        // a local problem per pair of coupled blocks, blocks without
+        // neighbours are local problems of their own
+        Array<bool> inpatch(nb);
+        inpatch = false;
+        for (size_t i = 0; i < nb; i++)
+            for (int j : nbblocks[i])
+                inpatch[i] = inpatch[j] = true;
+        Array<int> localsize;
+        for (size_t i = 0; i < nb; i++)
+        {
+            if (GetCols(i).Size() == 0) continue;
+            if (!inpatch[i])
+                localsize.Append(GetCols(i).Size());
+            for (int j : nbblocks[i])
+                localsize.Append(GetCols(i).Size() + GetCols(j).Size());
+        }
+        auto localdofs = make_shared<Table<int>>(localsize);
+        size_t l = 0;
+        for (size_t i = 0; i < nb; i++)
+        {
+            if (GetCols(i).Size() == 0) continue;
+            if (!inpatch[i])
+            {
+                int k = 0;
+                for (int c : GetCols(i)) (*localdofs)[l][k++] = c;
+                l++;
+            }
+            for (int j : nbblocks[i])
+            {
+                int k = 0;
+                for (int c : GetCols(i)) (*localdofs)[l][k++] = c;
+                for (int c : GetCols(j)) (*localdofs)[l][k++] = c;
+                l++;
+            }
+        }
+        return PtAP->CreateBlockJacobiPrecond(localdofs);
     }
 
-    void LapackSVD (SliceMatrix<Complex, ColMajor> A,
-                    SliceMatrix<Complex, ColMajor> U,
-                    SliceMatrix<Complex, ColMajor> V)
+    template class EmbeddingMatrix<double>;
+    template class EmbeddingMatrix<Complex>;
+
+
+    template <class SCAL>
+    void ElementPseudoInverse<SCAL> :: Mult (const BaseVector & x, BaseVector & y) const
     {
-        static Timer t("LapackSVD"); RegionTimer reg(t);
-        ngbla::integer n = A.Width(), m = A.Height();
-        Vector<> S(min(n,m));
-        Array<Complex> work(4*m*m+6*m+m+100);
-        Array<int> iwork(max(n,m)*9);
-        Array<double> rwork(5*max(n,m)*min(n,m)+5*min(n,m));
-        ngbla::integer info;
-        char jobz = 'A';
-        ngbla::integer lda = A.Dist(), ldu = U.Dist(), ldv = V.Dist();
-        ngbla::integer lwork = work.Size();
+        y = 0.0;
+        MultAdd (1.0, x, y);
+    }
 
-        zgesdd_ ( &jobz, &m, &n, A.Data(), &lda,
-                 S.Data(),
-                 U.Data(), &ldu, V.Data(), &ldv,
-                 work.Data(), &lwork, rwork.Data(), iwork.Data(),
-                 &info);
-        if(info!=0)
-            throw Exception("something went wrong in the svd " + std::to_string(info));
-        A = 0.0;
-        A.Diag(0) = S;
+    template <class SCAL>
+    void ElementPseudoInverse<SCAL> :: MultAdd (double s, const BaseVector & x, BaseVector & y) const
+    {
+        static Timer t("ElementPseudoInverse::MultAdd"); RegionTimer reg(t);
+        auto fx = x.FV<SCAL>();
+        auto fy = y.FV<SCAL>();
+        ParallelFor (blocks->GetNBlocks(), [&] (size_t i)
+        {
+            FlatMatrix<SCAL> B = blocks->GetBlock(i);
+            if (B.Width() == 0) return;
+            VectorMem<100,SCAL> xe(B.Width());
+            for (size_t l = 0; l < xe.Size(); l++)
+                xe(l) = IsRegularDof(testdofs[i][l]) ? fx(testdofs[i][l]) : SCAL(0.0);
+            // the rows of different elements do not overlap
+            fy(blocks->GetRowDofs(i)) += s * B * xe;
+        });
     }
-#endif
 
     template <class SCAL>
-    void GetSVD (SliceMatrix<SCAL> A,
-                    SliceMatrix<SCAL, ColMajor> U,
-                    SliceMatrix<SCAL, ColMajor> V)
+    void ElementPseudoInverse<SCAL> :: Apply (const MultiVector & x, MultiVector & y) const
     {
-        Matrix<SCAL,ColMajor> AA = A;
-        //Matrix<SCAL,ColMajor> AA(A.Height(),A.Width());
-        //for(int i=0;i<A.Height();i++)
-            //for(int j=0;j<A.Width();j++)
-                //AA(i,j)= A(i,j);
-#ifdef LAPACK
-        LapackSVD(AA,U,V);
-#else
-        CalcSVD(AA,U,V);
-#endif
-        A = 0.0;
-        //A.Diag(0)=AA.Diag();
-        for(int i=0;i<min(A.Width(),A.Height());i++)
-            A(i,i)=AA(i,i);
+        static Timer t("ElementPseudoInverse::Apply"); RegionTimer reg(t);
+        const size_t k = x.Size();
+        if (y.Size() != k)
+            throw Exception("ElementPseudoInverse::Apply: MultiVectors of different size");
+        Array<SCAL*> px(k), py(k);
+        for (size_t j = 0; j < k; j++)
+        {
+            px[j] = x[j]->FV<SCAL>().Data();
+            *y[j] = 0.0;
+            py[j] = y[j]->FV<SCAL>().Data();
+        }
+
+        LocalHeap glh(10*1000*1000, "pseudo inverse", true);
+        ParallelForRange (blocks->GetNBlocks(), [&] (IntRange r)
+        {
+            LocalHeap lh = glh.Split();
+            for (auto i : r)
+            {
+                HeapReset hr(lh);
+                FlatMatrix<SCAL> B = blocks->GetBlock(i);
+                if (B.Width() == 0) continue;
+                FlatArray<int> tdofs = testdofs[i], rows = blocks->GetRowDofs(i);
+                // all rhs of the element at once: Ue = B * Fe
+                FlatMatrix<SCAL> Fe(tdofs.Size(), k, lh), Ue(rows.Size(), k, lh);
+                for (size_t l = 0; l < tdofs.Size(); l++)
+                    for (size_t j = 0; j < k; j++)
+                        Fe(l,j) = IsRegularDof(tdofs[l]) ? px[j][tdofs[l]] : SCAL(0.0);
+                Ue = B * Fe;
+                for (size_t l = 0; l < rows.Size(); l++)
+                    for (size_t j = 0; j < k; j++)
+                        py[j][rows[l]] = Ue(l,j);
+            }
+        });
     }
 
-    template
-    void GetSVD<double>
-        (SliceMatrix<double> A, SliceMatrix<double, ColMajor> U, SliceMatrix<double, ColMajor> V);
+    template class ElementPseudoInverse<double>;
+    template class ElementPseudoInverse<Complex>;
 
-    template
-    void GetSVD<Complex>
-        (SliceMatrix<Complex> A, SliceMatrix<Complex, ColMajor> U, SliceMatrix<Complex, ColMajor> V);
-}
 
+    void EmbeddingStats :: Reset (size_t ne)
+    {
+        rank.SetSize(ne);
+        sigmamin.SetSize(ne);
+        sigmamax.SetSize(ne);
+        rank = 0;
+        sigmamin = 0.0;
+        sigmamax = 0.0;
+        minsigma = maxsigma = 0;
+        nsingular = 0;
+        niterative = 0;
+        nmixed = 0;
+        condhist.SetSize(0);
+    }
+
+    void EmbeddingStats :: Finish ()
+    {
+        constexpr int nbins = 17;  // the last bin collects condition numbers above 10^16
+        condhist.SetSize(nbins);
+        condhist = 0;
+        minsigma = std::numeric_limits<double>::max();
+        maxsigma = 0;
+        nsingular = 0;
+        for (size_t i = 0; i < rank.Size(); i++)
+        {
+            if (sigmamax[i] == 0) continue;
+            if (!(sigmamin[i] > 0))
+            {
+                // no finite condition number
+                nsingular++;
+                maxsigma = max(maxsigma, sigmamax[i]);
+                continue;
+            }
+            minsigma = min(minsigma, sigmamin[i]);
+            maxsigma = max(maxsigma, sigmamax[i]);
+            double cond = sigmamax[i] / sigmamin[i];
+            condhist[min(nbins-1, max(0, int(floor(log10(cond)))))]++;
+        }
+        if (maxsigma == 0)
+            minsigma = 0;
+    }
+
+
+    // On a distributed mesh every rank embeds its own elements. The Trefftz
+    // dofs belong to one element and are never shared between ranks, P maps
+    // them to the cumulated dofs of fes on the rank.
+    template <class SCAL>
+    static std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>,shared_ptr<BaseMatrix>>
+    DistributeEmbedding (shared_ptr<BaseMatrix> P, shared_ptr<BaseVector> lfvec, shared_ptr<BaseMatrix> PI,
+                         shared_ptr<FESpace> fes, shared_ptr<FESpace> test_fes)
+    {
+        auto pardofs = fes->GetParallelDofs();
+        if (!pardofs)
+            return std::make_tuple(P, lfvec, PI);
+
+        Array<int> nprocs(P->Width());
+        nprocs = 0;
+        auto trefftz_pardofs = make_shared<ParallelDofs> (pardofs->GetCommunicator(), Table<int>(nprocs),
+                                                         1, is_same<SCAL,Complex>::value);
+        // row pardofs belong to the width, column pardofs to the height
+        shared_ptr<BaseMatrix> parP = make_shared<ParallelMatrix> (P, trefftz_pardofs, pardofs, C2C);
+        shared_ptr<BaseVector> parlfvec;
+        if (lfvec)
+        {
+            auto vec = make_shared<ParallelVVector<SCAL>> (lfvec->Size(), pardofs, CUMULATED);
+            vec->FV() = lfvec->FV<SCAL>();
+            parlfvec = vec;
+        }
+        shared_ptr<BaseMatrix> parPI;
+        if (PI)
+            parPI = make_shared<ParallelMatrix> (PI, test_fes->GetParallelDofs(), pardofs, C2C);
+        return std::make_tuple(parP, parlfvec, parPI);
+    }
 
-namespace ngcomp
-{
 
     template <class SCAL>
-    std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>> EmbTrefftz (shared_ptr<SumOfIntegrals> bf,
+    std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>,shared_ptr<BaseMatrix>> EmbTrefftz (shared_ptr<SumOfIntegrals> bf,
                                        shared_ptr<FESpace> fes,
                                        shared_ptr<SumOfIntegrals> lf,
-                                       double eps, shared_ptr<FESpace> test_fes, int tndof
+                                       double eps, shared_ptr<FESpace> test_fes, int tndof,
+                                       bool reuse_svd, string method, bool blockdiag,
+                                       string outfile, string cachedir, bool pseudoinverse,
+                                       double releps, bool equilibrate, shared_ptr<EmbeddingStats> stats,
+                                       shared_ptr<BaseMatrix> aprevious, shared_ptr<BitArray> changed
                                        )
     {
         static Timer svdtt("svdtrefftz"); RegionTimer reg(svdtt);
         LocalHeap lh(1000 * 1000 * 1000);
 
 
-        if(eps==0 && tndof==0 && test_fes==nullptr)
-            throw Exception("Need to specify eps, tndof, or test_fes");
+        if(eps==0 && releps==0 && tndof==0 && test_fes==nullptr)
+            throw Exception("Need to specify eps, releps, tndof, or test_fes");
 
         bool mixed_mode = true;
         if(test_fes == nullptr){
@@ -111,14 +2112,64 @@ namespace ngcomp
             test_fes = fes;
         }
 
+        SVD_METHOD svdmethod = GetSVDMethod(method);
+        if(svdmethod == SVD_LOBPCG && tndof == 0)
+            throw Exception("method lobpcg needs the number of Trefftz fcts tndof");
+
+        // the element pseudo inverses give the particular solution of lf, or
+        // are returned to compute particular solutions for other rhs
+        const bool needpinv = lf || pseudoinverse;
+        if(pseudoinverse && outfile != "")
+            throw Exception("TrefftzEmbedding: pseudoinverse is not available with outfile");
+
         auto ma = fes->GetMeshAccess();
 
+        // incremental update of a previous embedding: only the changed
+        // elements are decomposed, the blocks of the others are kept
+        shared_ptr<EmbeddingMatrix<SCAL>> previous;
+        if(aprevious)
+        {
+            if(auto parmat = dynamic_pointer_cast<ParallelMatrix>(aprevious))
+                aprevious = parmat->GetMatrix();
+            previous = dynamic_pointer_cast<EmbeddingMatrix<SCAL>>(aprevious);
+            if(!previous)
+                throw Exception("TrefftzEmbedding: previous needs to be an EmbeddingMatrix (blockdiag=True)");
+            if(!changed)
+                throw Exception("TrefftzEmbedding: previous needs the changed elements");
+            if(previous->GetNBlocks() != ma->GetNE(VOL) || size_t(previous->Height()) != fes->GetNDof()
+               || changed->Size() != ma->GetNE(VOL))
+                throw Exception("TrefftzEmbedding: previous embedding does not match the mesh and space");
+            if(needpinv || outfile != "" || cachedir != "")
+                throw Exception("TrefftzEmbedding: previous is not available with lf, pseudoinverse, outfile or cachedir");
+        }
+        auto skipelement = [&](size_t elnr) { return previous && !changed->Test(elnr); };
+
+        // element_boundary integrals (dx.element_vb == BND) are evaluated by
+        // the volume integrators, boundary terms are added to the element
+        // matrices of the elements at the boundary
         Array<shared_ptr<BilinearFormIntegrator>> bfis[4];  // VOL, BND, ...
+        Array<shared_ptr<FacetBilinearFormIntegrator>> bndfacetbfis;
         for (auto icf : bf->icfs)
         {
             auto & dx = icf->dx;
-            bfis[dx.vb] += icf->MakeBilinearFormIntegrator();
+            auto bfi = icf->MakeBilinearFormIntegrator();
+            if (bfi->SkeletonForm())
+            {
+                if (dx.vb != BND)
+                    throw Exception("TrefftzEmbedding: integrals over inner facets couple elements, use dx(element_boundary=True)");
+                if (mixed_mode)
+                    throw Exception("TrefftzEmbedding: boundary facet integrals need the same trial and test space");
+                bndfacetbfis += dynamic_pointer_cast<FacetBilinearFormIntegrator>(bfi);
+            }
+            else if (dx.vb == VOL || dx.vb == BND)
+                bfis[dx.vb] += bfi;
+            else
+                throw Exception("TrefftzEmbedding: only integrals over elements, element boundaries and the boundary are supported");
         }
+        Array<int> facet2sel(ma->GetNFacets());
+        facet2sel = -1;
+        if (bfis[BND].Size() || bndfacetbfis.Size())
+            FacetToSurfaceElement(*ma, facet2sel);
 
         Array<shared_ptr<LinearFormIntegrator>> lfis[4];
         if(lf)
@@ -128,20 +2179,156 @@ namespace ngcomp
                 lfis[dx.vb] += icf->MakeLinearFormIntegrator();
             }
 
-        shared_ptr<SparseMatrix<SCAL>> P;
         VVector<SCAL> lfvec(fes->GetNDof());
+        lfvec = 0.0;
+
+        // element vector of lf on the test element
+        auto calcelvec = [&] (ElementId ei, ElementTransformation & trafo, const FiniteElement & test_fel,
+                              FlatVector<SCAL> elvec, LocalHeap & mlh)
+        {
+            FlatVector<SCAL> elveci(elvec.Size(), mlh);
+            elvec = 0.0;
+            for (auto & lfi : lfis[VOL])
+            {
+                if (lfi->DefinedOnElement(ei.Nr()))
+                {
+                    auto & mapped_trafo = trafo.AddDeformation(lfi->GetDeformation().get(), mlh);
+                    lfi -> CalcElementVector(test_fel, mapped_trafo, elveci, mlh);
+                    elvec += elveci;
+                }
+            }
+        };
 
-        std::once_flag init_flag;
-        Table<int> table,table2;
+        // the pseudo inverse blocks act on the test dofs of the elements
+        auto makepinv = [&] (shared_ptr<EmbeddingMatrix<SCAL>> pinvblocks) -> shared_ptr<BaseMatrix>
+        {
+            const size_t ne = ma->GetNE(VOL);
+            Array<int> testsize(ne);
+            ParallelFor (ne, [&] (size_t elnr)
+            {
+                ArrayMem<DofId,100> dnums;
+                test_fes->GetDofNrs (ElementId(VOL,elnr), dnums);
+                testsize[elnr] = dnums.Size();
+            });
+            Table<int> testdofs(testsize);
+            ParallelFor (ne, [&] (size_t elnr)
+            {
+                ArrayMem<DofId,100> dnums;
+                test_fes->GetDofNrs (ElementId(VOL,elnr), dnums);
+                for (size_t l = 0; l < dnums.Size(); l++)
+                    testdofs[elnr][l] = dnums[l];
+            });
+            return make_shared<ElementPseudoInverse<SCAL>>(pinvblocks, std::move(testdofs), test_fes->GetNDof());
+        };
 
-        ma->IterateElements(VOL,lh,[&](auto ei, LocalHeap & mlh)
+        // embeddings found in the cache directory are mapped, the element
+        // pseudo inverses are stored as well to compute particular solutions
+        string cachefile, pinvfile;
+        if (cachedir != "")
         {
-            HeapReset hr(mlh);
-            Array<DofId> test_dofs;
-            test_fes->GetDofNrs(ei, test_dofs);
-            Array<DofId> dofs;
-            fes->GetDofNrs(ei, dofs);
+            if (outfile != "")
+                throw Exception("TrefftzEmbedding: use either outfile or cachedir");
+            string key = EmbeddingKey<SCAL>(bf, fes, test_fes, mixed_mode, eps, tndof, method,
+                                            releps, equilibrate);
+            std::filesystem::create_directories(cachedir);
+            cachefile = cachedir + "/embedding_" + key + ".bin";
+            pinvfile = cachedir + "/pinv_" + key + ".bin";
+            shared_ptr<EmbeddingMatrix<SCAL>> PE, pinv;
+            if (std::filesystem::exists(cachefile) && (!needpinv || std::filesystem::exists(pinvfile)))
+            {
+                try
+                {
+                    PE = make_shared<EmbeddingMatrix<SCAL>>(cachefile);
+                    if (needpinv)
+                        pinv = make_shared<EmbeddingMatrix<SCAL>>(pinvfile);
+                }
+                catch (const Exception & e)
+                {
+                    // corrupt or truncated cache files are computed again
+                    cout << IM(3) << "TrefftzEmbedding: ignoring cache entry, " << e.What() << endl;
+                    PE = nullptr;
+                    pinv = nullptr;
+                    std::filesystem::remove(cachefile);
+                    std::filesystem::remove(pinvfile);
+                }
+            }
+            if (PE)
+            {
+                if (lf)
+                {
+                    ma->IterateElements(VOL, lh, [&] (auto ei, LocalHeap & mlh)
+                    {
+                        HeapReset hr(mlh);
+                        FlatMatrix<SCAL> elinverse = pinv->GetBlock(ei.Nr());
+                        if (elinverse.Width() == 0) return;
+                        auto & trafo = ma->GetTrafo(ei, mlh);
+                        auto & test_fel = test_fes->GetFE(ei, mlh);
+                        FlatVector<SCAL> elvec(test_fel.GetNDof(), mlh);
+                        calcelvec(ei, trafo, test_fel, elvec, mlh);
+                        lfvec.FV()(pinv->GetRowDofs(ei.Nr())) = elinverse * elvec;
+                    });
+                }
+                shared_ptr<BaseMatrix> P = PE;
+                if (!blockdiag)
+                    P = PE->CreateSparseMatrix();
+                if (stats)
+                {
+                    // only the ranks are known without the decompositions
+                    stats->Reset(PE->GetNBlocks());
+                    for (size_t i = 0; i < PE->GetNBlocks(); i++)
+                        stats->rank[i] = PE->GetRowDofs(i).Size() - PE->GetCols(i).Size();
+                    stats->Finish();
+                }
+                return DistributeEmbedding<SCAL>(P, make_shared<VVector<SCAL>>(lfvec),
+                                                 pseudoinverse ? makepinv(pinv) : nullptr, fes, test_fes);
+            }
+        }
+
+        unique_ptr<SVDCache<SCAL>> svdcache;
+        if(reuse_svd)
+            svdcache = make_unique<SVDCache<SCAL>>(svdmethod);
+
+        // rows of P: the regular dofs of each element, computed in parallel
+        // assumption here: Either all or no dof is regular
+        const size_t ne = ma->GetNE(VOL);
+        if (stats)
+            stats->Reset(ne);
+        Array<int> rowsize(ne);
+        ParallelFor (ne, [&] (size_t elnr)
+        {
+            ArrayMem<DofId,100> dnums;
+            fes->GetDofNrs (ElementId(VOL,elnr), dnums);
+            int cnt = 0;
+            for (DofId d : dnums)
+                if (IsRegularDof(d)) cnt++;
+            rowsize[elnr] = cnt;
+        });
+        Table<int> table(rowsize);
+        ParallelFor (ne, [&] (size_t elnr)
+        {
+            ArrayMem<DofId,100> dnums;
+            fes->GetDofNrs (ElementId(VOL,elnr), dnums);
+            int cnt = 0;
+            for (DofId d : dnums)
+                if (IsRegularDof(d)) table[elnr][cnt++] = d;
+        });
+
+        // The number of (weak) Trefftz fcts may differ from element to element.
+        // In a first pass the local null spaces are computed and stored per
+        // thread, P is set up once the local dimensions are known.
+        Array<int> nzs(ne);
+        nzs = 0;
+        Array<Array<SCAL>> threadblocks(TaskManager::GetMaxThreads());
+        Array<int> blockthread(ne);
+        Array<size_t> blockoffset(ne);
+        Array<int> pinvcols(ne);
+        pinvcols = 0;
+        Array<Array<SCAL>> threadpinv(TaskManager::GetMaxThreads());
+        Array<size_t> pinvoffset(ne);
 
+        // element matrix of bf, false if bf is not defined on the element
+        auto calcelmat = [&](ElementId ei, FlatMatrix<SCAL> & elmat, LocalHeap & mlh) -> bool
+        {
             bool definedhere = false;
             for (auto icf : bf->icfs)
             {
@@ -150,14 +2337,14 @@ namespace ngcomp
                         definedhere = true;
             }
             if (!definedhere)
-                return; // escape lambda
+                return false;
 
             auto & trafo = ma->GetTrafo(ei, mlh);
 
             auto & test_fel = test_fes->GetFE(ei, mlh);
             auto & trial_fel = fes->GetFE(ei, mlh);
 
-            FlatMatrix<SCAL> elmat(test_dofs.Size(), dofs.Size(), mlh);
+            elmat.AssignMemory(test_fel.GetNDof(), trial_fel.GetNDof(), mlh);
             elmat = 0.0;
             bool symmetric_so_far = true;
             int bfi_ind = 0;
@@ -188,97 +2375,419 @@ namespace ngcomp
                     }
                 }
             }
-            FlatMatrix<SCAL,ColMajor> U(test_dofs.Size(),mlh), Vt(dofs.Size(),mlh);
-            ngbla::GetSVD<SCAL>(elmat,U,Vt);
 
-            // assumption here: all (active) elements have the same number of (weak) Trefftz fcts.
+            if (bfis[BND].Size() == 0 && bndfacetbfis.Size() == 0)
+                return true;
+            auto fnums = ma->GetElFacets(ei);
+            for (size_t facnr = 0; facnr < fnums.Size(); facnr++)
+            {
+                int sel = facet2sel[fnums[facnr]];
+                if (sel < 0) continue;
+                HeapReset hr(mlh);
+                ElementId sei(BND, sel);
+                auto & strafo = ma->GetTrafo(sei, mlh);
+
+                if (bndfacetbfis.Size())
+                {
+                    auto vnums = ma->GetElVertices(ei);
+                    auto svnums = ma->GetElVertices(sei);
+                    FlatMatrix<SCAL> facetmat(elmat.Height(), elmat.Width(), mlh);
+                    for (auto & bfi : bndfacetbfis)
+                    {
+                        if (!bfi->DefinedOn(ma->GetElIndex(sei))) continue;
+                        bfi->CalcFacetMatrix(trial_fel, facnr, trafo, vnums, strafo, svnums, facetmat, mlh);
+                        elmat += facetmat;
+                    }
+                }
+
+                if (bfis[BND].Size() == 0) continue;
+                auto & test_sfel = test_fes->GetFE(sei, mlh);
+                auto & trial_sfel = fes->GetFE(sei, mlh);
+                Array<DofId> test_sdofs(test_sfel.GetNDof(), mlh), sdofs(trial_sfel.GetNDof(), mlh);
+                test_fes->GetDofNrs(sei, test_sdofs);
+                fes->GetDofNrs(sei, sdofs);
+                if (test_sdofs.Size() == 0 || sdofs.Size() == 0) continue;
+                FlatMatrix<SCAL> selmat(test_sdofs.Size(), sdofs.Size(), mlh);
+                selmat = 0.0;
+                for (auto & bfi : bfis[BND])
+                {
+                    if (!bfi->DefinedOn(ma->GetElIndex(sei)) || !bfi->DefinedOnElement(sel)) continue;
+                    if(mixed_mode)
+                        bfi -> CalcElementMatrixAdd(MixedFiniteElement(trial_sfel, test_sfel), strafo, selmat, symmetric_so_far, mlh);
+                    else
+                        bfi -> CalcElementMatrixAdd(test_sfel, strafo, selmat, symmetric_so_far, mlh);
+                }
+
+                // the dofs of the surface element are dofs of the element
+                Array<DofId> test_dofs(test_fel.GetNDof(), mlh), dofs(trial_fel.GetNDof(), mlh);
+                test_fes->GetDofNrs(ei, test_dofs);
+                fes->GetDofNrs(ei, dofs);
+                FlatArray<int> test_pos(test_sdofs.Size(), mlh), pos(sdofs.Size(), mlh);
+                bool found = true;
+                for (size_t i = 0; i < test_sdofs.Size(); i++)
+                    if ((test_pos[i] = test_dofs.Pos(test_sdofs[i])) < 0) found = false;
+                for (size_t j = 0; j < sdofs.Size(); j++)
+                    if ((pos[j] = dofs.Pos(sdofs[j])) < 0) found = false;
+                if (!found)
+                    throw Exception("TrefftzEmbedding: dofs of boundary element " + std::to_string(sel)
+                                    + " are not dofs of element " + std::to_string(ei.Nr()));
+                for (size_t i = 0; i < test_sdofs.Size(); i++)
+                    for (size_t j = 0; j < sdofs.Size(); j++)
+                        elmat(test_pos[i], pos[j]) += selmat(i,j);
+            }
+            return true;
+        };
+
+        // diagonal equilibration Dr*elmat*Dc by the inverse row and column
+        // norms, the scalings are empty without equilibration
+        auto equilibrateelmat = [&](FlatMatrix<SCAL> elmat, FlatVector<double> & rowscale,
+                                    FlatVector<double> & colscale, LocalHeap & mlh)
+        {
+            rowscale.AssignMemory(equilibrate ? elmat.Height() : 0, mlh);
+            colscale.AssignMemory(equilibrate ? elmat.Width() : 0, mlh);
+            if (!equilibrate)
+                return;
+            for (size_t i = 0; i < elmat.Height(); i++)
+            {
+                double nrm = L2Norm(elmat.Row(i));
+                rowscale(i) = nrm > 0 ? 1.0/nrm : 1.0;
+                elmat.Row(i) *= rowscale(i);
+            }
+            for (size_t j = 0; j < elmat.Width(); j++)
+            {
+                double nrm = L2Norm(elmat.Col(j));
+                colscale(j) = nrm > 0 ? 1.0/nrm : 1.0;
+                elmat.Col(j) *= colscale(j);
+            }
+        };
+
+        // null space block and particular solution of an element from the
+        // decomposition of its (equilibrated) matrix, singular values on the
+        // diagonal unless only the null space was computed (hassigma)
+        auto finishelement = [&](ElementId ei, FlatMatrix<SCAL> elmat, FlatMatrix<SCAL,ColMajor> U,
+                                 FlatMatrix<SCAL,ColMajor> Vt, FlatVector<double> rowscale,
+                                 FlatVector<double> colscale, bool hassigma, LocalHeap & mlh)
+        {
+            HeapReset hr(mlh);
+            const int ndof = elmat.Width(), ntest = elmat.Height();
+            const int nsigma = hassigma ? min(ndof, ntest) : 0;
             int nz = 0;
             if(tndof)
                 nz = tndof;
             else
             {
-                nz = trial_fel.GetNDof() - test_fel.GetNDof();
-                for(int i = 0; i < min(elmat.Width(), elmat.Height()); i++) if(abs(elmat(i,i)) < eps) nz++;
+                // singular values are sorted descending
+                double threshold = eps;
+                if(nsigma) threshold = max(threshold, releps * abs(elmat(0,0)));
+                nz = ndof - ntest;
+                for(int i = 0; i < nsigma; i++) if(abs(elmat(i,i)) < threshold) nz++;
+            }
+            nz = min(nz, ndof);
+            if(rowsize[ei.Nr()] == 0) nz = 0;
+            nzs[ei.Nr()] = nz;
+
+            if(stats)
+            {
+                const int rank = ndof - nz;
+                stats->rank[ei.Nr()] = rank;
+                if(min(rank, nsigma) > 0)
+                {
+                    stats->sigmamax[ei.Nr()] = abs(elmat(0,0));
+                    stats->sigmamin[ei.Nr()] = abs(elmat(min(rank, nsigma)-1, min(rank, nsigma)-1));
+                }
+            }
+
+            int tid = TaskManager::GetThreadId();
+            Array<SCAL> & blocks = threadblocks[tid];
+            blockthread[ei.Nr()] = tid;
+            blockoffset[ei.Nr()] = blocks.Size();
+            blocks.SetSize(blocks.Size() + ndof*nz);
+            FlatMatrix<SCAL> PP(ndof,nz,blocks.Data()+blockoffset[ei.Nr()]);
+            PP = Trans(Vt.Rows(ndof-nz,ndof));
+            // null space of elmat = Dc * null space of the equilibrated matrix
+            for(size_t j = 0; j < colscale.Size(); j++)
+                PP.Row(j) *= colscale(j);
+
+
+            if(needpinv)
+            {
+                // pseudo inverse V * Sigma^-1 * Ut, from the first nnz singular
+                // vectors (views into U and Vt, nothing is copied)
+                const int nnz = ndof - nz;
+                auto Ut = Trans(U).Rows(0,nnz);
+                auto V = Trans(Vt).Cols(0,nnz);
+                if(lf)
+                {
+                    auto & trafo = ma->GetTrafo(ei, mlh);
+                    auto & test_fel = test_fes->GetFE(ei, mlh);
+                    FlatVector<SCAL> elvec(ntest, mlh), hv(nnz, mlh), ue(ndof, mlh);
+                    calcelvec(ei, trafo, test_fel, elvec, mlh);
+                    for(size_t i = 0; i < rowscale.Size(); i++) elvec(i) *= rowscale(i);
+                    hv = Ut * elvec;
+                    for(int i = 0; i < nnz; i++) hv(i) /= elmat(i,i);
+                    ue = V * hv;
+                    for(size_t j = 0; j < colscale.Size(); j++) ue(j) *= colscale(j);
+                    lfvec.FV()(table[ei.Nr()]) = ue;
+                }
+
+                // the full pseudo inverse is only formed when it is kept
+                if (pseudoinverse || cachefile != "")
+                {
+                    Array<SCAL> & pinvblocks = threadpinv[tid];
+                    pinvcols[ei.Nr()] = ntest;
+                    pinvoffset[ei.Nr()] = pinvblocks.Size();
+                    pinvblocks.SetSize(pinvblocks.Size() + ndof*ntest);
+                    FlatMatrix<SCAL> SigIUt(nnz, ntest, mlh);
+                    for(int i = 0; i < nnz; i++)
+                        SigIUt.Row(i) = (SCAL(1.0)/elmat(i,i)) * Ut.Row(i);
+                    for(size_t l = 0; l < rowscale.Size(); l++)
+                        SigIUt.Col(l) *= rowscale(l);
+                    FlatMatrix<SCAL> elinverse(ndof, ntest, pinvblocks.Data()+pinvoffset[ei.Nr()]);
+                    elinverse = V * SigIUt;
+                    for(size_t j = 0; j < colscale.Size(); j++)
+                        elinverse.Row(j) *= colscale(j);
+                }
+            }
+        };
+
+        auto calcelement = [&](ElementId ei, LocalHeap & mlh)
+        {
+            HeapReset hr(mlh);
+            if (skipelement(ei.Nr()))
+                return;
+            FlatMatrix<SCAL> elmat;
+            if (!calcelmat(ei, elmat, mlh))
+                return;
+            FlatVector<double> rowscale, colscale;
+            equilibrateelmat(elmat, rowscale, colscale, mlh);
+            FlatMatrix<SCAL,ColMajor> U(elmat.Height(),0,mlh), Vt(elmat.Width(),mlh);
+            // single precision SVD with refined null space for real spaces,
+            // the double SVD below is the fallback
+            if constexpr (is_same<SCAL,double>::value)
+                if(svdmethod == SVD_MIXED && !needpinv
+                   && ngbla::GetNullSpaceMixed(elmat,eps,releps,tndof,Vt,mlh))
+                {
+                    if (stats)
+                        AsAtomic(stats->nmixed)++;
+                    finishelement(ei, elmat, U, Vt, rowscale, colscale, true, mlh);
+                    return;
+                }
+            // the iterative solver only gives the null space, without lf it
+            // replaces the SVD unless it does not converge
+            if(svdmethod == SVD_LOBPCG && !needpinv
+               && ngbla::GetNullSpace<SCAL>(elmat,min(tndof,int(elmat.Width())),eps,Vt,mlh))
+            {
+                if (stats)
+                    AsAtomic(stats->niterative)++;
+                finishelement(ei, elmat, U, Vt, rowscale, colscale, false, mlh);
+                return;
+            }
+            // the left singular vectors are only needed for the particular
+            // solution and by the decompositions which compute them anyway
+            if(needpinv || svdmethod != SVD_GRAM)
+                U.AssignMemory(elmat.Height(), elmat.Height(), mlh);
+            if(svdcache)
+            {
+                svdcache->GetSVD(ma->GetElType(ei),elmat,U,Vt,mlh);
+                finishelement(ei, elmat, U, Vt, rowscale, colscale, true, mlh);
+            }
+            else
+            {
+                CalcElementSVD<SCAL>(svdmethod,elmat,U,Vt,mlh);
+                finishelement(ei, elmat, U, Vt, rowscale, colscale, true, mlh);
             }
+        };
 
-            std::call_once(init_flag, [&](){
-                TableCreator<int> creator(ma->GetNE(VOL));
-                TableCreator<int> creator2(ma->GetNE(VOL));
-                int prevdofs = 0;
-                for ( ; !creator.Done(); creator++,creator2++)
+        // a range of elements; the Jacobi kernel decomposes batches of
+        // SIMD-width many equally sized element matrices at once
+        auto calcelements = [&](IntRange r, LocalHeap & mlh)
+        {
+            if constexpr (is_same<SCAL,double>::value)
+                if (svdmethod == SVD_JACOBI && !svdcache)
                 {
-                    prevdofs = 0;
-                    for(auto ei : ma->Elements(VOL))
+                    constexpr size_t W = SIMD<double>::Size();
+                    size_t elnr = r.First();
+                    // an element matrix of a different size than its batch is
+                    // kept outside the heap and starts the next batch
+                    Array<double> pending;
+                    size_t pendingnr = 0, pendingh = 0, pendingw = 0;
+                    bool haspending = false;
+                    while (elnr < r.Next() || haspending)
                     {
-                        Array<DofId> dnums;
-                        fes->GetDofNrs (ei, dnums);
-                        bool hasregdof = false;
-                        for (DofId d : dnums)
-                            if (IsRegularDof(d))
+                        HeapReset hr(mlh);
+                        ArrayMem<ElementId,W> els;
+                        ArrayMem<FlatMatrix<double>,W> mats(W);
+                        ArrayMem<FlatVector<double>,W> rowscales(W), colscales(W);
+                        if (haspending)
+                        {
+                            FlatMatrix<double> elmat(pendingh, pendingw, mlh);
+                            elmat = FlatMatrix<double>(pendingh, pendingw, pending.Data());
+                            mats[0].AssignMemory(pendingh, pendingw, elmat.Data());
+                            equilibrateelmat(elmat, rowscales[0], colscales[0], mlh);
+                            els.Append(ElementId(VOL, pendingnr));
+                            haspending = false;
+                        }
+                        while (elnr < r.Next() && els.Size() < W)
+                        {
+                            ElementId ei(VOL, elnr++);
+                            if (skipelement(ei.Nr()))
+                                continue;
+                            FlatMatrix<double> elmat;
+                            if (!calcelmat(ei, elmat, mlh))
+                                continue;
+                            if (els.Size() && (elmat.Height() != mats[0].Height() || elmat.Width() != mats[0].Width()))
                             {
-                                creator.Add (ei.Nr(), d);
-                                hasregdof = true;
+                                pendingnr = ei.Nr();
+                                pendingh = elmat.Height();
+                                pendingw = elmat.Width();
+                                pending.SetSize(pendingh*pendingw);
+                                FlatMatrix<double>(pendingh, pendingw, pending.Data()) = elmat;
+                                haspending = true;
+                                break;
                             }
-                        // assumption here: Either all or no dof is regular
-                        if (hasregdof)
+                            mats[els.Size()].AssignMemory(elmat.Height(), elmat.Width(), elmat.Data());
+                            equilibrateelmat(elmat, rowscales[els.Size()], colscales[els.Size()], mlh);
+                            els.Append(ei);
+                        }
+                        const size_t nb = els.Size();
+                        if (nb == 0)
+                            continue;
+                        const size_t uwidth = needpinv ? mats[0].Height() : 0;
+                        ArrayMem<FlatMatrix<double,ColMajor>,W> Us(nb), Vts(nb);
+                        for (size_t l = 0; l < nb; l++)
                         {
-                            for (int d=0;d<nz;d++)
-                                creator2.Add (ei.Nr(), d+prevdofs);
-                            prevdofs += nz;
+                            Us[l].AssignMemory(mats[0].Height(), uwidth, mlh);
+                            Vts[l].AssignMemory(mats[0].Width(), mats[0].Width(), mlh);
                         }
+                        ngbla::BatchedJacobiSVD(mats.Range(0,nb), Us, Vts, mlh);
+                        for (size_t l = 0; l < nb; l++)
+                            finishelement(els[l], mats[l], Us[l], Vts[l], rowscales[l], colscales[l], true, mlh);
                     }
+                    return;
                 }
-                table = creator.MoveTable();
-                table2 = creator2.MoveTable();
-
-                SparseMatrix<SCAL> PP(fes->GetNDof(), prevdofs, table,table2,false);
-                P = make_shared<SparseMatrix<SCAL>>(PP);
-                P->SetZero();
-            });
+            for (auto elnr : r)
+                calcelement(ElementId(VOL,elnr), mlh);
+        };
 
-            Matrix<SCAL> PP = Trans(Vt.Rows(dofs.Size()-nz,dofs.Size()));
-            P->AddElementMatrix(table[ei.Nr()],table2[ei.Nr()], PP);
+        if (outfile != "")
+        {
+            // out of core: the elements are processed in chunks, the blocks of
+            // each chunk are appended to the embedding file in element order
+            EmbeddingWriter<SCAL> writer(outfile, fes->GetNDof());
+            const size_t chunksize = 16 * 1024;
+            for (size_t first = 0; first < ne; first += chunksize)
+            {
+                IntRange chunk(first, min(first+chunksize, ne));
+                ParallelForRange (chunk, [&] (IntRange r)
+                {
+                    LocalHeap mlh = lh.Split();
+                    calcelements(r, mlh);
+                });
+                for (auto elnr : chunk)
+                    if (nzs[elnr])
+                        writer.WriteBlocks(threadblocks[blockthread[elnr]].Range(blockoffset[elnr], blockoffset[elnr]+rowsize[elnr]*nzs[elnr]));
+                for (auto & blocks : threadblocks)
+                    blocks.SetSize0();
+            }
+            writer.Finish(nzs, table, lf ? lfvec.FV().Data() : nullptr);
+            if (stats)
+                stats->Finish();
+            auto PE = make_shared<EmbeddingMatrix<SCAL>>(outfile);
+            return DistributeEmbedding<SCAL>(PE, PE->GetParticularSolution(), nullptr, fes, test_fes);
+        }
 
+        if (svdmethod == SVD_JACOBI)
+            ParallelForRange (ne, [&] (IntRange r)
+            {
+                LocalHeap mlh = lh.Split();
+                calcelements(r, mlh);
+            });
+        else
+            ma->IterateElements(VOL, lh, calcelement);
 
-            if(lf)
+        shared_ptr<BaseMatrix> PI;
+        if (pseudoinverse || (cachefile != "" && lf))
+        {
+            Table<int> pinvrows(rowsize);
+            for (size_t elnr = 0; elnr < ne; elnr++)
+                pinvrows[elnr] = table[elnr];
+            auto pinv = make_shared<EmbeddingMatrix<SCAL>>(fes->GetNDof(), std::move(pinvrows), pinvcols);
+            for (size_t elnr = 0; elnr < ne; elnr++)
+                if (pinvcols[elnr])
+                    pinv->GetBlock(elnr) = FlatMatrix<SCAL>(rowsize[elnr], pinvcols[elnr],
+                                           threadpinv[blockthread[elnr]].Data() + pinvoffset[elnr]);
+            for (auto & pinvblocks : threadpinv)
+                pinvblocks = Array<SCAL>();
+            if (cachefile != "")
             {
-                int nnz = dofs.Size() - nz;
+                SaveToCache(*pinv, pinvfile);
+            }
+            if (pseudoinverse)
+                PI = makepinv(pinv);
+        }
 
-                FlatVector<SCAL> elvec(test_dofs.Size(), mlh), elveci(test_dofs.Size(), mlh);
-                elvec = 0.0;
-                for (auto & lfi : lfis[VOL])
+        // the previous embedding is patched in place if no changed element
+        // changes the shape of its block, otherwise P is set up again
+        bool inplace = previous != nullptr;
+        if (previous)
+            for (size_t elnr = 0; elnr < ne; elnr++)
+            {
+                bool samerows = size_t(rowsize[elnr]) == previous->GetRowDofs(elnr).Size();
+                if (!skipelement(elnr))
                 {
-                    if (lfi->DefinedOnElement(ei.Nr()))
-                    {
-                        auto & mapped_trafo = trafo.AddDeformation(lfi->GetDeformation().get(), mlh);
-                        lfi -> CalcElementVector(test_fel, mapped_trafo, elveci, mlh);
-                        //lfi -> CalcElementVector(fel, mapped_trafo, elveci, mlh);
-                        elvec += elveci;
-                    }
+                    if (!samerows || size_t(nzs[elnr]) != previous->GetCols(elnr).Size()) inplace = false;
+                    continue;
                 }
-                Matrix<SCAL> Ut = Trans(U).Rows(0,nnz);
-                Matrix<SCAL> V = Trans(Vt).Cols(0,nnz);
-                Matrix<SCAL> SigI(nnz,nnz);
+                if (!samerows)
+                    throw Exception("TrefftzEmbedding: previous embedding does not match the dofs of element "
+                                    + std::to_string(elnr) + ", mark it as changed");
+                nzs[elnr] = previous->GetCols(elnr).Size();
+                if (stats)
+                    stats->rank[elnr] = rowsize[elnr] - nzs[elnr];
+            }
+        if (stats)
+            stats->Finish();
 
-                SigI = static_cast<SCAL>(0.0);
-                //SigI = 0.0;
-                for(int i=0;i<nnz;i++) SigI(i,i)=1.0/elmat(i,i);
-                Matrix<SCAL> elinverse = V*SigI*Ut;
-                lfvec.FV()(table[ei.Nr()])=elinverse*elvec;
+        // columns of P: consecutive blocks of the local Trefftz fcts
+        auto PE = inplace ? previous : make_shared<EmbeddingMatrix<SCAL>>(fes->GetNDof(), std::move(table), nzs);
+        ParallelFor (ne, [&] (size_t elnr)
+        {
+            if (nzs[elnr] == 0) return;
+            if (skipelement(elnr))
+            {
+                if (!inplace)
+                    PE->GetBlock(elnr) = previous->GetBlock(elnr);
+                return;
             }
+            PE->GetBlock(elnr) = FlatMatrix<SCAL>(rowsize[elnr], nzs[elnr],
+                                threadblocks[blockthread[elnr]].Data() + blockoffset[elnr]);
         });
+        for (auto & blocks : threadblocks)
+            blocks = Array<SCAL>();
+        if (cachefile != "")
+        {
+            SaveToCache(*PE, cachefile);
+        }
+
+        shared_ptr<BaseMatrix> P = PE;
+        if (!blockdiag)
+            P = PE->CreateSparseMatrix();
 
-        return std::make_tuple(P,make_shared<VVector<SCAL>>(lfvec));
+        return DistributeEmbedding<SCAL>(P, make_shared<VVector<SCAL>>(lfvec), PI, fes, test_fes);
     }
 
   template
-      std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>> EmbTrefftz<double>
+      std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>,shared_ptr<BaseMatrix>> EmbTrefftz<double>
           (shared_ptr<SumOfIntegrals> bf, shared_ptr<FESpace> fes, shared_ptr<SumOfIntegrals> lf,
-                                       double eps, shared_ptr<FESpace> test_fes, int tndof);
+                                       double eps, shared_ptr<FESpace> test_fes, int tndof, bool reuse_svd, string method, bool blockdiag, string outfile, string cachedir, bool pseudoinverse,
+                                       double releps, bool equilibrate, shared_ptr<EmbeddingStats> stats,
+                                       shared_ptr<BaseMatrix> previous, shared_ptr<BitArray> changed);
   template
-      std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>> EmbTrefftz<Complex>
+      std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>,shared_ptr<BaseMatrix>> EmbTrefftz<Complex>
           (shared_ptr<SumOfIntegrals> bf, shared_ptr<FESpace> fes, shared_ptr<SumOfIntegrals> lf,
-                                       double eps, shared_ptr<FESpace> test_fes, int tndof);
+                                       double eps, shared_ptr<FESpace> test_fes, int tndof, bool reuse_svd, string method, bool blockdiag, string outfile, string cachedir, bool pseudoinverse,
+                                       double releps, bool equilibrate, shared_ptr<EmbeddingStats> stats,
+                                       shared_ptr<BaseMatrix> previous, shared_ptr<BitArray> changed);
 
 }
 
@@ -287,19 +2796,153 @@ namespace ngcomp
 //#include <comp.hpp>
 //#include <fem.hpp>
 //using namespace ngfem;
+template <class SCAL>
+void ExportEmbeddingMatrix(py::module m, string name)
+{
+    using ngcomp::EmbeddingMatrix;
+    py::class_<EmbeddingMatrix<SCAL>, shared_ptr<EmbeddingMatrix<SCAL>>, ngla::BaseMatrix>
+        (m, name.c_str(), "Block diagonal Trefftz embedding, one dense block per element.")
+        .def("CreateSparseMatrix", &EmbeddingMatrix<SCAL>::CreateSparseMatrix,
+             "Copy the embedding to a SparseMatrix.")
+        .def("GalerkinProduct", [] (EmbeddingMatrix<SCAL> & self, shared_ptr<ngla::BaseMatrix> mat)
+             {
+                 auto spmat = dynamic_pointer_cast<ngla::SparseMatrix<SCAL>>(mat);
+                 if (!spmat)
+                     throw Exception("GalerkinProduct needs a SparseMatrix");
+                 return self.GalerkinProduct(*spmat);
+             }, R"mydelimiter(
+                Assembles the reduced matrix P^T*mat*P block by block.
+
+                :param mat: SparseMatrix of the DG space.
+
+                :return: SparseMatrix of the Trefftz space
+            )mydelimiter", py::arg("mat"))
+        .def("GalerkinProduct", [] (EmbeddingMatrix<SCAL> & self, shared_ptr<ngfem::SumOfIntegrals> bf,
+                                    shared_ptr<ngcomp::FESpace> fes)
+             {
+                 return self.GalerkinProduct(bf, fes);
+             }, R"mydelimiter(
+                Assembles the reduced matrix P^T*A*P directly from the element and facet
+                matrices of bf, without assembling the DG matrix A.
+
+                :param bf: operator of the DG formulation, integrals over elements and (skeleton) facets.
+                :param fes: DG finite element space of the embedding.
+
+                :return: SparseMatrix of the Trefftz space
+            )mydelimiter", py::arg("bf"), py::arg("fes"))
+        .def("CreatePreconditioner", [] (EmbeddingMatrix<SCAL> & self, shared_ptr<ngla::BaseMatrix> mat, bool patches)
+             {
+                 auto spmat = dynamic_pointer_cast<ngla::SparseMatrix<SCAL>>(mat);
+                 if (!spmat)
+                     throw Exception("CreatePreconditioner needs a SparseMatrix");
+                 return self.CreateSchwarzPreconditioner(spmat, patches);
+             }, R"mydelimiter(
+                Additive Schwarz (block Jacobi) preconditioner for the reduced matrix P^T*A*P,
+                to be used with CG or GMRES instead of a direct inverse.
+
+                :param mat: SparseMatrix of the Trefftz space, e.g. from GalerkinProduct.
+                :param patches: Local problems on the Trefftz dofs of pairs of coupled (neighbouring) elements instead of single elements, defaults to False
+
+                :return: Preconditioner
+            )mydelimiter", py::arg("mat"), py::arg("patches")=false)
+        .def("Save", &EmbeddingMatrix<SCAL>::Save, R"mydelimiter(
+                Writes the embedding to a file that can be mapped by LoadTrefftzEmbedding.
+
+                :param filename: Output file.
+                :param lfvec: Particular solution stored with the embedding, defaults to None
+            )mydelimiter", py::arg("filename"), py::arg("lfvec")=nullptr)
+        .def("GetParticularSolution", &EmbeddingMatrix<SCAL>::GetParticularSolution,
+             "Particular solution stored in the embedding file, None if there is none.")
+        .def_property_readonly("mapped", &EmbeddingMatrix<SCAL>::IsMapped);
+}
+
+template <class TA>
+py::list ToPyList (const TA & a)
+{
+    py::list l;
+    for (auto v : a)
+        l.append(v);
+    return l;
+}
+
+template <class SCAL>
+void ExportElementPseudoInverse(py::module m, string name)
+{
+    using ngcomp::ElementPseudoInverse;
+    py::class_<ElementPseudoInverse<SCAL>, shared_ptr<ElementPseudoInverse<SCAL>>, ngla::BaseMatrix>
+        (m, name.c_str(), "Element pseudo inverses of a Trefftz embedding, maps rhs vectors of the test space to particular solutions.")
+        .def("Apply", [] (ElementPseudoInverse<SCAL> & self, shared_ptr<ngla::MultiVector> x,
+                          shared_ptr<ngla::MultiVector> y)
+             {
+                 self.Apply(*x, *y);
+             }, R"mydelimiter(
+                Particular solutions for many rhs at once, one matrix-matrix product per element.
+
+                :param x: MultiVector of rhs vectors, assembled on the test space.
+                :param y: MultiVector of the particular solutions, overwritten.
+            )mydelimiter", py::arg("x"), py::arg("y"))
+        .def_property_readonly("blocks", &ElementPseudoInverse<SCAL>::GetBlocks,
+                               "The pseudo inverse blocks as EmbeddingMatrix, columns are the test dofs of the elements.");
+}
+
 void ExportEmbTrefftz(py::module m)
 {
+    ExportEmbeddingMatrix<double>(m, "EmbeddingMatrix");
+    ExportEmbeddingMatrix<Complex>(m, "EmbeddingMatrixC");
+    ExportElementPseudoInverse<double>(m, "ElementPseudoInverse");
+    ExportElementPseudoInverse<Complex>(m, "ElementPseudoInverseC");
+
+    py::class_<ngcomp::EmbeddingStats, shared_ptr<ngcomp::EmbeddingStats>>
+        (m, "TrefftzEmbeddingStats", "Ranks and retained singular values of the element matrices, filled by TrefftzEmbedding(..., stats=...).")
+        .def(py::init<>())
+        .def_property_readonly("rank", [] (ngcomp::EmbeddingStats & self)
+             { return ToPyList(self.rank); },
+             "Number of retained singular values per element.")
+        .def_property_readonly("sigmamin", [] (ngcomp::EmbeddingStats & self)
+             { return ToPyList(self.sigmamin); },
+             "Smallest retained singular value per element, 0 if unknown.")
+        .def_property_readonly("sigmamax", [] (ngcomp::EmbeddingStats & self)
+             { return ToPyList(self.sigmamax); },
+             "Largest singular value per element, 0 if unknown.")
+        .def_readonly("minsigma", &ngcomp::EmbeddingStats::minsigma)
+        .def_readonly("maxsigma", &ngcomp::EmbeddingStats::maxsigma)
+        .def_property_readonly("condhist", [] (ngcomp::EmbeddingStats & self)
+             { return ToPyList(self.condhist); },
+             "condhist[i]: number of elements with condition number in [10^i,10^(i+1)), the last entry counts all above.")
+        .def_readonly("nsingular", &ngcomp::EmbeddingStats::nsingular,
+             "Number of elements whose smallest retained singular value is zero, they are not counted in condhist.")
+        .def_readonly("niterative", &ngcomp::EmbeddingStats::niterative,
+             "Number of elements whose null space was computed by the iterative solver (method=\"lobpcg\").")
+        .def_readonly("nmixed", &ngcomp::EmbeddingStats::nmixed,
+             "Number of elements whose null space was refined from the single precision SVD (method=\"mixed\").");
+
+    m.def("LoadTrefftzEmbedding", &ngcomp::LoadEmbedding, R"mydelimiter(
+                Maps an embedding file written by TrefftzEmbedding(..., outfile=...)
+                or EmbeddingMatrix.Save. The blocks are read from the file on demand.
+
+                :param filename: Embedding file.
+
+                :return: EmbeddingMatrix
+            )mydelimiter", py::arg("filename"));
+
     m.def("TrefftzEmbedding", [] (shared_ptr<ngfem::SumOfIntegrals> bf,
                             shared_ptr<ngcomp::FESpace> fes,
                             shared_ptr<ngfem::SumOfIntegrals> lf,
                             double eps,
-                            shared_ptr<ngcomp::FESpace> test_fes, int tndof
-                            )
+                            shared_ptr<ngcomp::FESpace> test_fes, int tndof, bool reuse_svd, string method, bool blockdiag,
+                            string outfile, string cachedir, bool pseudoinverse,
+                            double releps, bool equilibrate, shared_ptr<ngcomp::EmbeddingStats> stats,
+                            shared_ptr<ngcomp::BaseMatrix> previous, shared_ptr<ngcomp::BitArray> changed
+                            ) -> py::tuple
           {
-              if(fes->IsComplex())
-                  return ngcomp::EmbTrefftz<Complex>(bf,fes,lf,eps,test_fes,tndof);
-
-              return ngcomp::EmbTrefftz<double>(bf,fes,lf,eps,test_fes,tndof);
+              auto res = fes->IsComplex()
+                  ? ngcomp::EmbTrefftz<Complex>(bf,fes,lf,eps,test_fes,tndof,reuse_svd,method,blockdiag,outfile,cachedir,pseudoinverse,
+                                                releps,equilibrate,stats,previous,changed)
+                  : ngcomp::EmbTrefftz<double>(bf,fes,lf,eps,test_fes,tndof,reuse_svd,method,blockdiag,outfile,cachedir,pseudoinverse,
+                                                releps,equilibrate,stats,previous,changed);
+              if(pseudoinverse)
+                  return py::make_tuple(std::get<0>(res), std::get<1>(res), std::get<2>(res));
+              return py::make_tuple(std::get<0>(res), std::get<1>(res));
           }, R"mydelimiter(
                 Computes the Trefftz embedding and particular solution.
 
@@ -309,28 +2952,54 @@ void ExportEmbTrefftz(py::module m)
                 :param eps: Threshold for singular values to be considered zero, defaults to 0
                 :param test_fes: Used if test space differs from trial space, defaults to None
                 :param tndof: If known, local ndofs of the Trefftz space, also eps and/or test_fes are used to find the dimension, defaults to 0
+                :param reuse_svd: Reuse the SVD of elements whose element matrices coincide up to scaling (e.g. structured meshes). Up to 1024 distinct element matrices are cached, each entry keeps the matrix and its singular vectors, about 2*m*n+m^2+n^2 scalars for an m x n element matrix, defaults to False
+                :param method: Local decomposition, "svd" for a full SVD, "eig" for an eigen decomposition of elmat^H*elmat (cheaper, but only resolves singular values above sqrt(machine eps)*|elmat|), "jacobi" for a one-sided Jacobi SVD of SIMD-width batches of equally sized element matrices (real spaces), "lobpcg" for an iterative solver for the tndof null vectors of each element (O(n^2*tndof) instead of O(n^3), needs tndof, particular solutions use the SVD), "hermitian" for an eigen decomposition of Hermitian element matrices (e.g. Helmholtz with trial=test space, falls back to the SVD for other elements), or "mixed" for a single precision SVD with the null space refined in double (real spaces, falls back to the double SVD per element if the refinement does not reach double accuracy, particular solutions use the SVD), defaults to "svd"
+                :param blockdiag: Return the embedding as block diagonal EmbeddingMatrix instead of a SparseMatrix, defaults to False
+                :param outfile: Process the elements in chunks and write the embedding (and particular solution) to this file, the returned EmbeddingMatrix maps the file, defaults to "" (in memory)
+                :param cachedir: Local directory caching embeddings (and element pseudo inverses), keyed by a hash of mesh, bf (including the values of GridFunction and Parameter coefficients), flags and dofs of the spaces and parameters. A cached embedding is reused without any local decomposition. Curved geometries and other coefficients with state that is not printed are not part of the key and may give stale results, defaults to "" (no cache)
+                :param pseudoinverse: Also return the element pseudo inverses as ElementPseudoInverse, applied to (a MultiVector of) rhs vectors assembled on the test space it gives their particular solutions, defaults to False
+
+                :param releps: Threshold for singular values relative to the largest singular value of the element, combined with eps, defaults to 0
+                :param equilibrate: Scale rows and columns of the element matrices to unit norm before the decomposition, thresholds then apply to the equilibrated matrices, defaults to False
+                :param stats: TrefftzEmbeddingStats filled with the ranks and retained singular values of the elements, defaults to None
+                :param previous: EmbeddingMatrix (blockdiag=True) of the same mesh and space to be updated, only the elements in changed are decomposed again. The blocks are patched in place if the changed elements keep their number of Trefftz fcts. Not available with lf, pseudoinverse, outfile and cachedir, defaults to None
+                :param changed: BitArray of the changed elements for previous, defaults to None
 
-                :return: [Trefftz embeddint, particular solution]
+                On distributed meshes (MPI) every rank embeds its own elements, the embedding (and pseudo inverses) are returned as ParallelMatrix on rank-local Trefftz dofs, the particular solution as cumulated parallel vector.
+
+                :return: [Trefftz embeddint, particular solution(, element pseudo inverses)]
             )mydelimiter",
-          py::arg("bf"), py::arg("fes"), py::arg("lf"), py::arg("eps")=0, py::arg("test_fes")=nullptr, py::arg("tndof")=0);
+          py::arg("bf"), py::arg("fes"), py::arg("lf"), py::arg("eps")=0, py::arg("test_fes")=nullptr, py::arg("tndof")=0, py::arg("reuse_svd")=false, py::arg("method")="svd", py::arg("blockdiag")=false, py::arg("outfile")="", py::arg("cachedir")="", py::arg("pseudoinverse")=false,
+          py::arg("releps")=0, py::arg("equilibrate")=false, py::arg("stats")=nullptr,
+          py::arg("previous")=nullptr, py::arg("changed")=nullptr);
 
 
     m.def("TrefftzEmbedding", [] (shared_ptr<ngfem::SumOfIntegrals> bf,
                             shared_ptr<ngcomp::FESpace> fes,
                             double eps,
-                            shared_ptr<ngcomp::FESpace> test_fes, int tndof
-                            ) -> shared_ptr<ngcomp::BaseMatrix>
+                            shared_ptr<ngcomp::FESpace> test_fes, int tndof, bool reuse_svd, string method, bool blockdiag,
+                            string outfile, string cachedir, bool pseudoinverse,
+                            double releps, bool equilibrate, shared_ptr<ngcomp::EmbeddingStats> stats,
+                            shared_ptr<ngcomp::BaseMatrix> previous, shared_ptr<ngcomp::BitArray> changed
+                            ) -> py::object
           {
-              if(fes->IsComplex())
-                  return std::get<0>(ngcomp::EmbTrefftz<Complex>(bf,fes,nullptr,eps,test_fes,tndof));
-
-              return std::get<0>(ngcomp::EmbTrefftz<double>(bf,fes,nullptr,eps,test_fes,tndof));
+              auto res = fes->IsComplex()
+                  ? ngcomp::EmbTrefftz<Complex>(bf,fes,nullptr,eps,test_fes,tndof,reuse_svd,method,blockdiag,outfile,cachedir,pseudoinverse,
+                                                releps,equilibrate,stats,previous,changed)
+                  : ngcomp::EmbTrefftz<double>(bf,fes,nullptr,eps,test_fes,tndof,reuse_svd,method,blockdiag,outfile,cachedir,pseudoinverse,
+                                                releps,equilibrate,stats,previous,changed);
+              if(pseudoinverse)
+                  return py::make_tuple(std::get<0>(res), std::get<2>(res));
+              return py::cast(std::get<0>(res));
           }, R"mydelimiter(
-                Used without the parameter lf as input the function only returns the Trefftz embedding.
+                Used without the parameter lf as input the function only returns the Trefftz embedding,
+                and the element pseudo inverses if pseudoinverse is set.
 
-                :return: Trefftz embeddint
+                :return: Trefftz embeddint(, element pseudo inverses)
             )mydelimiter",
-          py::arg("bf"), py::arg("fes"), py::arg("eps")=0, py::arg("test_fes")=nullptr, py::arg("tndof")=0);
+          py::arg("bf"), py::arg("fes"), py::arg("eps")=0, py::arg("test_fes")=nullptr, py::arg("tndof")=0, py::arg("reuse_svd")=false, py::arg("method")="svd", py::arg("blockdiag")=false, py::arg("outfile")="", py::arg("cachedir")="", py::arg("pseudoinverse")=false,
+          py::arg("releps")=0, py::arg("equilibrate")=false, py::arg("stats")=nullptr,
+          py::arg("previous")=nullptr, py::arg("changed")=nullptr);
 
 }
 #endif // NGS_PYTHON
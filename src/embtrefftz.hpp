@@ -4,14 +4,169 @@
 #include <fem.hpp>
 #include <integratorcf.hpp>
 #include <variant>
+#include <unordered_map>
+#include <fstream>
 
 namespace ngcomp
 {
+  class MappedFile;
+
+  /*
+     Block diagonal Trefftz embedding. Each element holds a dense block,
+     mapping its Trefftz dofs (a consecutive range of columns) to its dofs.
+     The blocks are stored row-major and contiguously, either in memory
+     or in a memory mapped embedding file (see EmbeddingWriter).
+  */
+  template <class SCAL>
+  class EmbeddingMatrix : public BaseMatrix
+  {
+    protected:
+      size_t height, width;
+      Table<int> rowdofs;
+      Array<size_t> firstcol;  // block i has the columns [firstcol[i],firstcol[i+1])
+      Array<size_t> firstval;  // offsets of the blocks in values
+      Array<SCAL> values;
+      SCAL * data = nullptr;   // values, or the blocks in the mapped file
+      SCAL * lfdata = nullptr; // particular solution stored in the mapped file
+      shared_ptr<MappedFile> mapping;
+      bool overlap = false;    // dofs shared between elements
+
+      void Setup (FlatArray<int> ncols);
+
+      template <class TS>
+      void MultAddImpl (TS s, const BaseVector & x, BaseVector & y) const;
+      template <class TS>
+      void MultTransAddImpl (TS s, const BaseVector & x, BaseVector & y) const;
+
+      Table<int> ColTable () const;
+      void DofToBlock (FlatArray<int> dof2block, FlatArray<int> dof2loc) const;
+      // sparsity of P^T A P, block i couples with the blocks nbblocks[i]
+      shared_ptr<SparseMatrix<SCAL>> CreateGalerkinMatrix (const Table<int> & nbblocks,
+                                                          const Table<int> & rowcols) const;
+
+    public:
+      EmbeddingMatrix (size_t aheight, Table<int> && arowdofs, FlatArray<int> ncols);
+      // maps an embedding file written by EmbeddingWriter, the blocks are not copied
+      EmbeddingMatrix (string filename);
+
+      size_t GetNBlocks () const { return rowdofs.Size(); }
+      FlatArray<int> GetRowDofs (size_t i) const { return rowdofs[i]; }
+      IntRange GetCols (size_t i) const { return IntRange(firstcol[i], firstcol[i+1]); }
+      FlatMatrix<SCAL> GetBlock (size_t i) const
+      { return FlatMatrix<SCAL>(rowdofs[i].Size(), firstcol[i+1]-firstcol[i], data+firstval[i]); }
+      bool IsMapped () const { return mapping != nullptr; }
+
+      bool IsComplex () const override { return is_same<SCAL,Complex>::value; }
+      int VHeight () const override { return height; }
+      int VWidth () const override { return width; }
+      AutoVector CreateRowVector () const override { return make_unique<VVector<SCAL>>(width); }
+      AutoVector CreateColVector () const override { return make_unique<VVector<SCAL>>(height); }
+
+      void Mult (const BaseVector & x, BaseVector & y) const override;
+      void MultAdd (double s, const BaseVector & x, BaseVector & y) const override;
+      void MultAdd (Complex s, const BaseVector & x, BaseVector & y) const override;
+      void MultTrans (const BaseVector & x, BaseVector & y) const override;
+      void MultTransAdd (double s, const BaseVector & x, BaseVector & y) const override;
+      void MultTransAdd (Complex s, const BaseVector & x, BaseVector & y) const override;
+
+      shared_ptr<SparseMatrix<SCAL>> CreateSparseMatrix () const;
+      void Save (string filename, shared_ptr<BaseVector> lfvec = nullptr) const;
+      // particular solution stored in the embedding file, nullptr if there is none
+      shared_ptr<BaseVector> GetParticularSolution () const;
+      // assembles P^T A P block by block
+      shared_ptr<SparseMatrix<SCAL>> GalerkinProduct (const SparseMatrix<SCAL> & A) const;
+      // assembles P^T A P from the element and facet matrices of bf, A is never formed
+      shared_ptr<SparseMatrix<SCAL>> GalerkinProduct (shared_ptr<SumOfIntegrals> bf,
+                                                      shared_ptr<FESpace> fes) const;
+      // additive Schwarz preconditioner for PtAP = P^T A P, the local problems
+      // are the Trefftz dofs of an element, or of two coupled elements (patches)
+      shared_ptr<BaseMatrix> CreateSchwarzPreconditioner (shared_ptr<SparseMatrix<SCAL>> PtAP,
+                                                          bool patches) const;
+  };
+
+  /*
+     Writes an embedding file block by block. Layout: header, the blocks in
+     element order, the particular solution (optional), and the index
+     (columns and dofs of each block) at the end.
+  */
+  template <class SCAL>
+  class EmbeddingWriter
+  {
+      string filename;
+      ofstream out;
+      size_t height, nvalues = 0;
+
+    public:
+      EmbeddingWriter (string afilename, size_t aheight);
+      // blocks are appended in element order
+      void WriteBlocks (FlatArray<SCAL> blockvalues);
+      void Finish (FlatArray<int> ncols, const Table<int> & rowdofs, const SCAL * lfvec);
+  };
+
+  // EmbeddingMatrix or EmbeddingMatrixC, depending on the file
+  shared_ptr<BaseMatrix> LoadEmbedding (string filename);
+
+  /*
+     Element pseudo inverses of the Trefftz operator, block i maps the test
+     dofs of element i to its dofs. Applied to a rhs vector assembled on the
+     test space it gives the particular solution, Apply handles many rhs
+     at once with one matrix-matrix product per element.
+  */
+  template <class SCAL>
+  class ElementPseudoInverse : public BaseMatrix
+  {
+      shared_ptr<EmbeddingMatrix<SCAL>> blocks;
+      Table<int> testdofs;
+      size_t width;
+
+    public:
+      ElementPseudoInverse (shared_ptr<EmbeddingMatrix<SCAL>> ablocks, Table<int> && atestdofs, size_t awidth)
+        : blocks(ablocks), testdofs(std::move(atestdofs)), width(awidth) { ; }
+
+      shared_ptr<EmbeddingMatrix<SCAL>> GetBlocks () const { return blocks; }
+
+      bool IsComplex () const override { return is_same<SCAL,Complex>::value; }
+      int VHeight () const override { return blocks->Height(); }
+      int VWidth () const override { return width; }
+      AutoVector CreateRowVector () const override { return make_unique<VVector<SCAL>>(width); }
+      AutoVector CreateColVector () const override { return make_unique<VVector<SCAL>>(blocks->Height()); }
+
+      void Mult (const BaseVector & x, BaseVector & y) const override;
+      void MultAdd (double s, const BaseVector & x, BaseVector & y) const override;
+      // y[j] = Pinv * x[j] for all vectors of x
+      void Apply (const MultiVector & x, MultiVector & y) const;
+  };
+
+  /*
+     Statistics of the local decompositions in EmbTrefftz, collected from
+     the singular values computed anyway. The rank of an element is the
+     number of retained (nonzero) singular values.
+  */
+  struct EmbeddingStats
+  {
+      Array<int> rank;
+      Array<double> sigmamin, sigmamax;  // retained singular values per element, 0 if unknown
+      double minsigma = 0, maxsigma = 0;
+      Array<size_t> condhist;             // condhist[i]: elements with condition number in [10^i,10^(i+1))
+      size_t nsingular = 0;               // elements without a positive retained singular value, not in condhist
+      size_t niterative = 0;              // elements decomposed by the iterative null space solver
+      size_t nmixed = 0;                  // elements with the null space refined from the single precision SVD
+
+      void Reset (size_t ne);
+      void Finish ();
+  };
+
+  // returns the embedding, the particular solution (lf) and the element
+  // pseudo inverses (pseudoinverse)
   template <class SCAL>
-  std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>> EmbTrefftz (shared_ptr<SumOfIntegrals> bf,
+  std::tuple<shared_ptr<BaseMatrix>,shared_ptr<BaseVector>,shared_ptr<BaseMatrix>> EmbTrefftz (shared_ptr<SumOfIntegrals> bf,
                        shared_ptr<FESpace> fes, 
                        shared_ptr<SumOfIntegrals> lf,
-                       double eps, shared_ptr<FESpace> fes_test, int tndof
+                       double eps, shared_ptr<FESpace> fes_test, int tndof,
+                       bool reuse_svd, string method, bool blockdiag,
+                       string outfile, string cachedir, bool pseudoinverse,
+                       double releps, bool equilibrate, shared_ptr<EmbeddingStats> stats,
+                       shared_ptr<BaseMatrix> previous, shared_ptr<BitArray> changed
                    );
 }
 
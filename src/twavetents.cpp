@@ -3,6 +3,7 @@
 #include <paralleldepend.hpp>
 #include "trefftzfespace.hpp"
 #include "intrule4.cpp"
+#include <map>
 
 namespace ngcomp
 {
@@ -13,20 +14,370 @@ namespace ngcomp
     }
 
 
+    // a is row major, LAPACK factorizes a^T and solves with the transpose
     template<int D>
-    inline void  TWaveTents<D> :: Solve(FlatMatrix<double> a, FlatVector<double> b)
+    inline void TWaveTents<D> :: Factorize(FlatMatrix<double> a, FlatArray<ngbla::integer> ipiv)
     {
-        CalcInverse(a,INVERSE_LIB::INV_LAPACK);
-        Vector<> c = a*b;
-        b=c;
+#ifdef LAPACK
+        ngbla::integer n = a.Height(), lda = a.Width(), info;
+        dgetrf_(&n, &n, a.Data(), &lda, ipiv.Data(), &info);
+        if(info > 0)
+            throw Exception("singular tent matrix, zero pivot " + std::to_string(info));
+        if(info < 0)
+            throw Exception("something went wrong in the tent factorization " + std::to_string(info));
+#else
+        CalcInverse(a);
+#endif
     }
 
     template<int D>
-    void TWaveTents<D> :: Propagate()
+    inline void TWaveTents<D> :: SolveFactorized(FlatMatrix<double> a, FlatArray<ngbla::integer> ipiv, FlatVector<double> b)
+    {
+#ifdef LAPACK
+        char trans = 'T';
+        ngbla::integer n = a.Height(), nrhs = 1, lda = a.Width(), ldb = b.Size(), info;
+        dgetrs_(&trans, &n, &nrhs, a.Data(), &lda, ipiv.Data(), b.Data(), &ldb, &info);
+        if(info != 0)
+            throw Exception("something went wrong in the tent solve " + std::to_string(info));
+#else
+        VectorMem<100> c(b.Size());
+        c = a*b;
+        b = c;
+#endif
+    }
+
+    template<int D>
+    inline void TWaveTents<D> :: Solve(FlatMatrix<double> a, FlatVector<double> b, LocalHeap & lh)
+    {
+        static Timer t("tent solve"); RegionTimer reg(t);
+        HeapReset hr(lh);
+        FlatArray<ngbla::integer> ipiv(a.Height(), lh);
+        Factorize(a, ipiv);
+        SolveFactorized(a, ipiv, b);
+    }
+
+    template<int D>
+    void TWaveTents<D> :: PrepareFactorCache()
+    {
+        size_t ntents = tps->GetNTents();
+        if(!cachefactors || tentslot.Size() == ntents) return;
+        int nslots = ntents;
+        if(cacheclasses)
+            nslots = ClassifyTents();
+        else
+        {
+            tentslot.SetSize(ntents);
+            for(size_t i=0;i<ntents;i++) tentslot[i] = i;
+        }
+        tentfactors.SetSize(nslots);
+        tentpivots.SetSize(nslots);
+        slotndof.SetSize(nslots);
+        slotndof = 0;
+        slotstate = Array<atomic<int>>(nslots);
+        for(auto & s : slotstate) s = 0;
+    }
+
+    template<int D>
+    void TWaveTents<D> :: ClearFactorCache()
+    {
+        tentslot.SetSize0();
+        tentfactors.SetSize0();
+        tentpivots.SetSize0();
+        slotndof.SetSize0();
+        slotstate = Array<atomic<int>>();
+    }
+
+    template<int D>
+    int TWaveTents<D> :: ClassifyTents()
+    {
+        static Timer t("tent classes"); RegionTimer reg(t);
+        // coordinates and times are compared up to 1e-10 of the mesh size,
+        // wavespeeds up to 1e-10 of the largest wavespeed
+        Vec<D> pmin = ma->GetPoint<D>(0), pmax = pmin;
+        for(size_t v=1;v<ma->GetNV();v++)
+        {
+            Vec<D> p = ma->GetPoint<D>(v);
+            for(int d=0;d<D;d++)
+            {
+                pmin(d) = min(pmin(d),p(d));
+                pmax(d) = max(pmax(d),p(d));
+            }
+        }
+        double xscale = 1e10/L2Norm(pmax-pmin);
+        double max_wavespeed = wavespeed[0];
+        for(double c : wavespeed) max_wavespeed = max(c,max_wavespeed);
+        double cscale = 1e10/max_wavespeed;
+
+        // the basis is scaled by TentAdiam, which evaluates the wavespeed at
+        // the vertices, the Dirichlet term evaluates it at the quadrature
+        // points of the boundary faces, so these values enter the key. The
+        // macro elements are built from exact comparisons of the element
+        // wavespeeds, their partition of the tent is part of the key
+        MakeThreadHeaps();
+        LocalHeap & lh = ThreadHeap();
+        HeapReset hr(lh);
+        IntegrationRule ir (ma->GetElType(ElementId(VOL,0)), 0);
+        MappedIntegrationPoint<D,D> mip(ir[0], ma->GetTrafo (0, lh));
+        auto vertexwavespeed = [&](int vnr)
+        {
+            mip.Point() = ma->GetPoint<D>(vnr);
+            return wavespeedcf->Evaluate(mip);
+        };
+        const ELEMENT_TYPE eltyp = (D==3) ? ET_TET : ((D==2) ? ET_TRIG : ET_SEGM);
+        SIMD_IntegrationRule sir(eltyp, order*2);
+        // same points as in CalcTentBndEl
+        auto bndwavespeed = [&](const Tent* tent, int surfel, std::vector<long long> & key)
+        {
+            HeapReset hr(lh);
+            Mat<D+1> vert = TentFaceVerts(tent, surfel, 0);
+            Mat<D+1,D> map;
+            for(int i=0;i<D;i++)
+                map.Col(i) = vert.Col(i+1) - vert.Col(0);
+            Vec<D+1> shift = vert.Col(0);
+            SIMD_MappedIntegrationRule<D,D+1> smir(sir,ma->GetTrafo(0,lh),-1,lh);
+            for(size_t imip=0;imip<sir.Size();imip++)
+            {
+                smir[imip].Point() = map * sir[imip].operator Vec<D,SIMD<double>>() + shift;
+                smir[imip].Point()[D] += timeshift;
+            }
+            FlatMatrix<SIMD<double>> c(1,sir.Size(),lh);
+            wavespeedcf->Evaluate(smir,c);
+            for(size_t imip=0;imip<sir.Size();imip++)
+                for(size_t l=0;l<SIMD<double>::Size();l++)
+                    key.push_back(std::llround(c(0,imip)[l]*cscale));
+        };
+
+        std::map<std::vector<long long>,int> classes;
+        tentslot.SetSize(tps->GetNTents());
+        for(size_t tentnr=0;tentnr<tps->GetNTents();tentnr++)
+        {
+            const Tent* tent =& tps->GetTent(tentnr);
+            Vec<D> x0 = ma->GetPoint<D>(tent->vertex);
+            std::vector<long long> key;
+            auto addverts = [&](Mat<D+1,D+1> v)
+            {
+                for(int i=0;i<D+1;i++)
+                {
+                    for(int d=0;d<D;d++)
+                        key.push_back(std::llround((v(d,i)-x0(d))*xscale));
+                    key.push_back(std::llround((v(D,i)-tent->tbot)*xscale));
+                }
+            };
+
+            key.push_back(std::llround((tent->ttop-tent->tbot)*xscale));
+            key.push_back(std::llround(TentAdiam(tent, lh)*xscale));
+            key.push_back(std::llround(vertexwavespeed(tent->vertex)*cscale));
+            for(auto vnr : tent->nbv)
+                key.push_back(std::llround(vertexwavespeed(vnr)*cscale));
+            std::unordered_map<int,int> macroel;
+            key.push_back(MakeMacroEl(tent->els, macroel));
+            for(auto elnr : tent->els)
+            {
+                key.push_back(std::llround(wavespeed[elnr]*cscale));
+                key.push_back(macroel[elnr]);
+                addverts(TentFaceVerts(tent, elnr, 1));
+            }
+            for(auto fnr : tent->internal_facets)
+            {
+                Array<int> elnums;
+                ma->GetFacetElements(fnr, elnums);
+                Array<int> selnums;
+                if(elnums.Size()==1) GetFacetSurfaceElement(ma, fnr, selnums);
+                if(elnums.Size()==1 && selnums.Size()==1)
+                {
+                    bool neumann = ma->GetMaterial(ElementId(BND,selnums[0])) == "neumann";
+                    key.push_back(neumann ? -2 : -1);
+                    addverts(TentFaceVerts(tent, selnums[0], 0));
+                    if(!neumann)
+                        bndwavespeed(tent, selnums[0], key);
+                }
+                else
+                    for(auto el : elnums)
+                        key.push_back(tent->els.Pos(el));
+            }
+            auto cls = classes.emplace(std::move(key), classes.size());
+            tentslot[tentnr] = cls.first->second;
+        }
+        return classes.size();
+    }
+
+    template<int D>
+    void TWaveTents<D> :: SolveCached(int tentnr, bool factored, FlatMatrix<double> a, FlatVector<double> b, LocalHeap & lh)
+    {
+        if(!cachefactors)
+        {
+            Solve(a, b, lh);
+            return;
+        }
+        static Timer t("tent solve cached"); RegionTimer reg(t);
+        int slot = tentslot[tentnr];
+        size_t n = b.Size();
+        if(!factored)
+        {
+            // the first tent of a slot stores its factors, tents of the same
+            // class running concurrently solve on their own
+            int expected = 0;
+            if(!slotstate[slot].compare_exchange_strong(expected, 1))
+            {
+                Solve(a, b, lh);
+                return;
+            }
+            slotndof[slot] = n;
+            tentfactors[slot].SetSize(n*n);
+            tentpivots[slot].SetSize(n);
+            FlatMatrix<double> lu(n, n, tentfactors[slot].Data());
+            lu = a;
+            Factorize(lu, tentpivots[slot]);
+            slotstate[slot] = 2;
+        }
+        SolveFactorized(FlatMatrix<double>(n, n, tentfactors[slot].Data()), tentpivots[slot], b);
+    }
+
+    template<int D>
+    void TWaveTents<D> :: MakeTentLevels()
+    {
+        size_t ntents = tps->GetNTents();
+        auto & dag = tps->tent_dependency;
+        Array<int> level(ntents), indegree(ntents), order;
+        level = 0; indegree = 0;
+        for(size_t i=0;i<ntents;i++)
+            for(auto j : dag[i]) indegree[j]++;
+        for(size_t i=0;i<ntents;i++)
+            if(indegree[i]==0) order.Append(i);
+        int nlevels = 0;
+        for(size_t k=0;k<order.Size();k++)
+        {
+            int i = order[k];
+            nlevels = max(nlevels, level[i]+1);
+            for(auto j : dag[i])
+            {
+                level[j] = max(level[j], level[i]+1);
+                if(--indegree[j]==0) order.Append(j);
+            }
+        }
+        TableCreator<int> creator(nlevels);
+        for( ; !creator.Done(); creator++)
+            for(size_t i=0;i<ntents;i++)
+                creator.Add(level[i], i);
+        tentlevels = creator.MoveTable();
+    }
+
+    template<int D>
+    void TWaveTents<D> :: MakeThreadHeaps()
+    {
+        size_t nthreads = TaskManager::GetMaxThreads();
+        if(threadheaps.Size() == nthreads) return;
+        threadheaps.SetSize(nthreads);
+        for(auto & heap : threadheaps)
+            heap = make_shared<LocalHeap>(1000 * 1000 * 1000 / nthreads, "trefftz tents");
+    }
+
+    template<int D>
+    template<typename TFUNC>
+    void TWaveTents<D> :: RunTents(TFUNC func)
     {
-        //int nthreads = (task_manager) ? task_manager->GetNumThreads() : 1;
-        LocalHeap lh(1000 * 1000 * 1000, "trefftz tents", 1);
+        MakeThreadHeaps();
+        if(batchsize <= 0)
+        {
+            RunParallelDependency (tps->tent_dependency, [&] (int tentnr) {
+                LocalHeap & slh = ThreadHeap();
+                HeapReset hr(slh);
+                func(tentnr, slh);
+            });
+            return;
+        }
+
+        RunTentBatches([&] (FlatArray<int> tents, LocalHeap & slh) {
+            for(auto tentnr : tents)
+            {
+                HeapReset hr(slh);
+                func(tentnr, slh);
+            }
+        });
+    }
+
+    template<int D>
+    template<typename TFUNC>
+    void TWaveTents<D> :: RunTentBatches(TFUNC func)
+    {
+        static Timer t("tent batches"); RegionTimer reg(t);
+        MakeThreadHeaps();
+        if(tentlevels.Size()==0) MakeTentLevels();
+        for(auto level : tentlevels)
+        {
+            size_t nbatches = (level.Size()+batchsize-1)/batchsize;
+            ParallelFor(nbatches, [&] (size_t batch) {
+                LocalHeap & slh = ThreadHeap();
+                HeapReset hr(slh);
+                size_t first = batch*batchsize;
+                size_t last = min(level.Size(), first+batchsize);
+                func(level.Range(first,last), slh);
+            });
+        }
+    }
+
+    // Gaussian elimination with partial pivoting of up to SIMD width many
+    // tent systems of equal size n at once, one system per lane. Rows are
+    // swapped lane by lane, the elimination is vectorized over the tents.
+    // Unused lanes solve with the identity.
+    template<int D>
+    void TWaveTents<D> :: SolveBatch(size_t n, FlatArray<double*> mats, FlatArray<double*> vecs, LocalHeap & lh)
+    {
+        static Timer t("tent solve batch"); RegionTimer reg(t);
+        constexpr size_t W = SIMD<double>::Size();
+        HeapReset hr(lh);
+        const size_t k = mats.Size();
+        FlatMatrix<SIMD<double>> a(n,n,lh);
+        FlatVector<SIMD<double>> b(n,lh);
+        auto lane = [] (SIMD<double> & v, size_t l) -> double & { return reinterpret_cast<double*>(&v)[l]; };
+        for(size_t i=0;i<n;i++)
+        {
+            for(size_t j=0;j<n;j++)
+                for(size_t l=0;l<W;l++)
+                    lane(a(i,j),l) = l < k ? mats[l][i*n+j] : double(i==j);
+            for(size_t l=0;l<W;l++)
+                lane(b(i),l) = l < k ? vecs[l][i] : 0.0;
+        }
+
+        for(size_t c=0;c<n;c++)
+        {
+            for(size_t l=0;l<k;l++)
+            {
+                size_t p = c;
+                for(size_t i=c+1;i<n;i++)
+                    if(abs(lane(a(i,c),l)) > abs(lane(a(p,c),l))) p = i;
+                if(lane(a(p,c),l) == 0)
+                    throw Exception("singular tent matrix");
+                if(p == c) continue;
+                for(size_t j=c;j<n;j++)
+                    swap(lane(a(c,j),l), lane(a(p,j),l));
+                swap(lane(b(c),l), lane(b(p),l));
+            }
+            SIMD<double> inv = SIMD<double>(1.0) / a(c,c);
+            for(size_t i=c+1;i<n;i++)
+            {
+                SIMD<double> f = a(i,c) * inv;
+                for(size_t j=c+1;j<n;j++)
+                    a(i,j) -= f * a(c,j);
+                b(i) -= f * b(c);
+            }
+        }
+        for(size_t i=n;i-- > 0;)
+        {
+            SIMD<double> s = b(i);
+            for(size_t j=i+1;j<n;j++)
+                s -= a(i,j) * b(j);
+            b(i) = s / a(i,i);
+        }
+
+        for(size_t l=0;l<k;l++)
+            for(size_t i=0;i<n;i++)
+                vecs[l][i] = lane(b(i),l);
+    }
 
+    template<int D>
+    void TWaveTents<D> :: Propagate()
+    {
         const ELEMENT_TYPE eltyp = (D==3) ? ET_TET : ((D==2) ? ET_TRIG : ET_SEGM);
         SIMD_IntegrationRule sir(eltyp, order*2);
         //const int ndomains = ma->GetNDomains();
@@ -41,21 +392,42 @@ namespace ngcomp
         static Timer ttenteval("tenteval");
 
         CSR basismat = TWaveBasis<D>::Basis(order, 0, fosystem);
+        PrepareFactorCache();
 
-        RunParallelDependency (tps->tent_dependency, [&] (int tentnr) {
-            LocalHeap slh = lh.Split();  // split to threads
-            const Tent* tent =& tps->GetTent(tentnr);
-
+        // system of a tent, kept from the assembly to the evaluation
+        struct TentSystem
+        {
+            double adiam;
+            std::unordered_map<int,int> macroel;
+            int ndomains;
+            bool factored;
+            FlatMatrix<> elmat;
+            FlatVector<> elvec;
+            Array<FlatMatrix<SIMD<double>>> topdshapes;
+        };
+        auto tentcenter = [&] (const Tent* tent)
+        {
             Vec<D+1> center;
             center.Range(0,D)=ma->GetPoint<D>(tent->vertex);
             center[D]=(tent->ttop-tent->tbot)/2+tent->tbot;
-            ScalarMappedElement<D+1> tel(nbasis,order,basismat,ET_TET,center,TentAdiam(tent),1);
+            return center;
+        };
 
-            std::unordered_map<int,int> macroel;
-            int ndomains = MakeMacroEl(tent->els, macroel);
+        // with cached factors of the same size only the right hand side is assembled
+        auto assemble = [&] (int tentnr, bool usefactors, TentSystem & ts, LocalHeap & slh)
+        {
+            const Tent* tent =& tps->GetTent(tentnr);
+            ts.adiam = TentAdiam(tent,slh);
+            ScalarMappedElement<D+1> tel(nbasis,order,basismat,ET_TET,tentcenter(tent),ts.adiam,1);
 
-            FlatMatrix<> elmat(ndomains*nbasis,slh);
-            FlatVector<> elvec(ndomains*nbasis,slh);
+            auto & macroel = ts.macroel;
+            int ndomains = ts.ndomains = MakeMacroEl(tent->els, macroel);
+            const bool factored = ts.factored = usefactors && IsFactored(tentnr, ndomains*nbasis);
+
+            ts.elmat.AssignMemory(ndomains*nbasis,ndomains*nbasis,slh);
+            ts.elvec.AssignMemory(ndomains*nbasis,slh);
+            FlatMatrix<> elmat = ts.elmat;
+            FlatVector<> elvec = ts.elvec;
             elmat = 0; elvec = 0;
 
             for(auto fnr : tent->internal_facets)
@@ -74,17 +446,18 @@ namespace ngcomp
 
                     SliceMatrix<> subm = elmat.Cols(eli*nbasis,(eli+1)*nbasis).Rows(eli*nbasis,(eli+1)*nbasis);
                     SliceVector<> subv = elvec.Range(eli*nbasis,(eli+1)*nbasis);
-                    CalcTentBndEl(selnums[0],tent,tel,sir,slh,subm,subv);
+                    CalcTentBndEl(selnums[0],tent,tel,sir,slh,subm,subv,!factored);
                 }
 
                 // Integrate macro bnd inside tent
-                else if(elnums.Size()==2 && ndomains>1 && macroel[elnums[0]] != macroel[elnums[1]])
+                else if(!factored && elnums.Size()==2 && ndomains>1 && macroel[elnums[0]] != macroel[elnums[1]])
                 {
                     CalcTentMacroEl(fnr, elnums, macroel, tent, tel, sir, slh, elmat, elvec);
                 }
             }
 
-            Array<FlatMatrix<SIMD<double>>> topdshapes(tent->els.Size());
+            auto & topdshapes = ts.topdshapes;
+            topdshapes.SetSize(tent->els.Size());
             for(auto& tds : topdshapes)
                 tds.AssignMemory((D+1)*nbasis, sir.Size(), slh);
             // Integrate top and bottom space-like tent faces
@@ -95,21 +468,64 @@ namespace ngcomp
                 SliceMatrix<> subm = elmat.Cols(eli*nbasis,(eli+1)*nbasis).Rows(eli*nbasis,(eli+1)*nbasis);
                 SliceVector<> subv = elvec.Range(eli*nbasis,(eli+1)*nbasis);
                 double bla = wavespeed[tent->els[elnr]];
-                CalcTentEl(tent->els[elnr],tent,tel,[&](int imip){return bla;},sir,slh,subm,subv,topdshapes[elnr]);
+                CalcTentEl(tent->els[elnr],tent,tel,[&](int imip){return bla;},sir,slh,subm,subv,topdshapes[elnr],!factored);
             }
+        };
 
-            // solve
-            Solve(elmat,elvec);
-            FlatVector<> sol(ndomains*nbasis, &elvec(0));
-
-            // eval solution on top of tent
+        // eval solution, stored in elvec, on top of tent
+        auto evaluate = [&] (int tentnr, TentSystem & ts, LocalHeap & slh)
+        {
+            const Tent* tent =& tps->GetTent(tentnr);
+            ScalarMappedElement<D+1> tel(nbasis,order,basismat,ET_TET,tentcenter(tent),ts.adiam,1);
+            FlatVector<> sol = ts.elvec;
             for(size_t elnr=0;elnr<tent->els.Size();elnr++)
             {
                 tel.SetWavespeed(wavespeed[tent->els[elnr]]);
-                int eli = ndomains>1 ? macroel[tent->els[elnr]] : 0;
-                CalcTentElEval(tent->els[elnr], tent, tel, sir, slh, sol.Range(eli*nbasis,(eli+1)*nbasis), topdshapes[elnr]);
+                int eli = ts.ndomains>1 ? ts.macroel[tent->els[elnr]] : 0;
+                CalcTentElEval(tent->els[elnr], tent, tel, sir, slh, sol.Range(eli*nbasis,(eli+1)*nbasis), ts.topdshapes[elnr]);
             }
-        }); // end loop over tents
+        };
+
+        if(batchsize > 0 && !cachefactors)
+            RunTentBatches([&] (FlatArray<int> tents, LocalHeap & slh) {
+                Array<TentSystem> systems(tents.Size());
+                for(size_t i=0;i<tents.Size();i++)
+                    assemble(tents[i], false, systems[i], slh);
+
+                // tents of equal size are solved together, one per SIMD lane
+                Array<int> sizes(tents.Size()), index(tents.Size());
+                for(size_t i=0;i<tents.Size();i++)
+                {
+                    sizes[i] = systems[i].elvec.Size();
+                    index[i] = i;
+                }
+                std::sort(index.Data(), index.Data()+index.Size(),
+                          [&] (int i, int j) { return sizes[i] < sizes[j]; });
+                constexpr size_t W = SIMD<double>::Size();
+                ArrayMem<double*,W> mats, vecs;
+                for(size_t first=0;first<index.Size();)
+                {
+                    mats.SetSize0(); vecs.SetSize0();
+                    size_t last = first;
+                    for( ; last<index.Size() && last-first<W && sizes[index[last]]==sizes[index[first]]; last++)
+                    {
+                        mats.Append(systems[index[last]].elmat.Data());
+                        vecs.Append(systems[index[last]].elvec.Data());
+                    }
+                    SolveBatch(sizes[index[first]], mats, vecs, slh);
+                    first = last;
+                }
+
+                for(size_t i=0;i<tents.Size();i++)
+                    evaluate(tents[i], systems[i], slh);
+            });
+        else
+            RunTents([&] (int tentnr, LocalHeap & slh) {
+                TentSystem ts;
+                assemble(tentnr, true, ts, slh);
+                SolveCached(tentnr,ts.factored,ts.elmat,ts.elvec,slh);
+                evaluate(tentnr, ts, slh);
+            });
         //cout<<"solved from " << timeshift;
         timeshift += tps->GetSlabHeight();
         //cout<<" to " << timeshift<<endl;
@@ -119,7 +535,7 @@ namespace ngcomp
     template<int D>
     template<typename TFUNC>
     void TWaveTents<D> :: CalcTentEl(int elnr, const Tent* tent, ScalarMappedElement<D+1> &tel, TFUNC LocalWavespeed,
-                                    SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec, SliceMatrix<SIMD<double>> simddshapes)
+                                    SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec, SliceMatrix<SIMD<double>> simddshapes, bool calcmat)
     {
         static Timer tint1("tent top calcshape");
         static Timer tint2("tent top AAt");
@@ -175,7 +591,8 @@ namespace ngcomp
             tel.CalcShape(smir,simdshapes);
             for(size_t imip=0;imip<sir.Size();imip++)
                 simdshapes.Col(imip) *= sqrt(area*sir[imip].Weight());
-            AddABt(simdshapes,simdshapes,elmat);
+            if(calcmat)
+                AddABt(simdshapes,simdshapes,elmat);
             for(size_t imip=0;imip<sir.Size();imip++)
                 simdshapes.Col(imip) *= sqrt(area*sir[imip].Weight());
             FlatMatrix<> shapes(nbasis,snip,reinterpret_cast<double*>(&simdshapes(0,0)));
@@ -192,6 +609,7 @@ namespace ngcomp
         tint1.Start();
         tel.CalcDShape(smir,simddshapes);
         tint1.Stop();
+        if(!calcmat) return;
 
         tint2.Start();
         area = TentFaceArea(vert);
@@ -229,7 +647,7 @@ namespace ngcomp
     }
 
     template<int D>
-    void TWaveTents<D> :: CalcTentBndEl(int surfel, const Tent* tent, ScalarMappedElement<D+1> &tel, SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec)
+    void TWaveTents<D> :: CalcTentBndEl(int surfel, const Tent* tent, ScalarMappedElement<D+1> &tel, SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec, bool calcmat)
     {
         HeapReset hr(slh);
         int nsimd = SIMD<double>::Size();
@@ -280,7 +698,8 @@ namespace ngcomp
                         bdbmat.Row(r*snip+imip) += (d<D?-n(d)*beta:1.0) * (-n(r)) * sir[imip/nsimd].Weight()[imip%nsimd]*area * bbmat.Col(d*snip+imip);
                         bdbvec(d*snip+imip) += (d<D?-n(d)*beta:-1.0) * (-n(r)) * bdeval(r,imip/nsimd)[imip%nsimd] * sir[imip/nsimd].Weight()[imip%nsimd]*area;
                     }
-            elmat += bbmat * bdbmat;
+            if(calcmat)
+                elmat += bbmat * bdbmat;
             elvec += bbmat * bdbvec;
         } else { // dirichlet
             FlatMatrix<SIMD<double>> bdeval(1,sir.Size(),slh);
@@ -301,7 +720,8 @@ namespace ngcomp
                     bdbvec(d*snip+imip) -= n(d) * weight * bdeval(0,imip/nsimd)[imip%nsimd];
                 }
             }
-            elmat += bbmat * bdbmat;
+            if(calcmat)
+                elmat += bbmat * bdbmat;
             elvec -= bbmat * bdbvec;
         }
     }
@@ -668,9 +1088,9 @@ namespace ngcomp
     }
 
     template<int D>
-    double TWaveTents<D> :: TentAdiam(const Tent* tent)
+    double TWaveTents<D> :: TentAdiam(const Tent* tent, LocalHeap & lh)
     {
-        LocalHeap lh(1000*1000*1000);
+        HeapReset hr(lh);
         int vnumber = tent->nbv.Size();
         //double c = wavespeed[tent->els[0]];
         //for(auto el : tent->els) c = max(c,wavespeed[el]);
@@ -709,9 +1129,10 @@ namespace ngcomp
     double TWaveTents<D> :: MaxAdiam()
     {
         double h = 0.0;
+        MakeThreadHeaps();
         RunParallelDependency (tps->tent_dependency, [&] (int tentnr) {
             const Tent* tent =& tps->GetTent(tentnr);
-            h = max(h,TentAdiam(tent));
+            h = max(h,TentAdiam(tent,ThreadHeap()));
         });
         return h;
     }
@@ -761,8 +1182,6 @@ namespace ngcomp
     template<int D>
     void QTWaveTents<D> :: Propagate()
     {
-        LocalHeap lh(1000 * 1000 * 1000, "QT tents", 1);
-
         shared_ptr<MeshAccess> ma = this->ma;
         const ELEMENT_TYPE eltyp = (D==3) ? ET_TET : ((D==2) ? ET_TRIG : ET_SEGM);
         const int nsimd = SIMD<double>::Size();
@@ -771,10 +1190,14 @@ namespace ngcomp
         QTWaveBasis<D> basis;
 
         //cout << "solving qt " << (this->tps)->GetNTents() << " tents in " << D << "+1 dimensions..." << endl;
+        // the quasi-Trefftz basis depends on the tent position
+        if(this->cacheclasses)
+            throw Exception("tent classes are not available for quasi-Trefftz tents");
+        this->PrepareFactorCache();
 
-        RunParallelDependency ((this->tps)->tent_dependency, [&] (int tentnr) {
-            LocalHeap slh = lh.Split();  // split to threads
+        this->RunTents([&] (int tentnr, LocalHeap & slh) {
             const Tent* tent =& (this->tps)->GetTent(tentnr);
+            const bool factored = this->IsFactored(tentnr, this->nbasis);
 
             Vec<D+1> center;
             center.Range(0,D)=ma->GetPoint<D>(tent->vertex);
@@ -804,7 +1227,7 @@ namespace ngcomp
 
                 this->CalcTentEl(tent->els[elnr],tent,tel,
                                  [&](int imip){return lwavespeed(0,imip/nsimd)[imip%nsimd];},
-                                 sir,slh,elmat,elvec,topdshapes[elnr]);
+                                 sir,slh,elmat,elvec,topdshapes[elnr],!factored);
             }
 
             for(auto fnr : tent->internal_facets)
@@ -816,11 +1239,11 @@ namespace ngcomp
 
                 // Integrate boundary tent
                 if(elnums.Size()==1 && selnums.Size()==1)
-                    this->CalcTentBndEl(selnums[0],tent,tel,sir,slh,elmat,elvec);
+                    this->CalcTentBndEl(selnums[0],tent,tel,sir,slh,elmat,elvec,!factored);
             }
 
-            //integrate volume of tent here
-            for(size_t elnr=0;elnr<tent->els.Size();elnr++)
+            //integrate volume of tent here, contributes to the matrix only
+            for(size_t elnr=0;elnr<tent->els.Size() && !factored;elnr++)
             {
                 /// Integration over bot and top volume of tent element
                 for(int part=-1;part<=1;part+=2)
@@ -878,7 +1301,7 @@ namespace ngcomp
             }
 
             // solve
-            Solve(elmat,elvec);
+            SolveCached(tentnr,factored,elmat,elvec,slh);
             FlatVector<> sol(nbasis, &elvec(0));
 
             // eval solution on top of tent
@@ -947,7 +1370,12 @@ void DeclareETClass(py::module &m, std::string typestr)
         .def("LocalDofs", &PyETclass::LocalDofs)
         .def("GetOrder", &PyETclass::GetOrder)
         .def("GetSpaceDim",&PyETclass::GetSpaceDim)
-        .def("GetInitmesh",&PyETclass::GetInitmesh);
+        .def("GetInitmesh",&PyETclass::GetInitmesh)
+        .def("SetCacheFactorizations",&PyETclass::SetCacheFactorizations, py::arg("cache")=true, py::arg("classes")=false,
+             "Keep the factorized tent matrices of the first slab and reuse them for later slabs, valid only for time independent coefficients. "
+             "With classes=True tents congruent up to translation share one factorization (not for quasi-Trefftz tents)")
+        .def("SetBatchSize",&PyETclass::SetBatchSize, py::arg("batchsize"),
+             "Process independent tents of the same dependency level in batches of this size, 0 schedules single tents by their dependencies");
 }
 
 void ExportTWaveTents(py::module m)
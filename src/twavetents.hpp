@@ -33,12 +33,27 @@ namespace ngcomp
             int fosystem = 0;
             double timeshift = 0;
             int nbasis;
+            // LU factors of the tent matrices, reused by later slabs when the
+            // coefficients do not depend on time. Factors are stored by slot,
+            // a single tent or a class of tents congruent up to translation
+            bool cachefactors = false;
+            bool cacheclasses = false;
+            Array<int> tentslot;
+            Array<Array<double>> tentfactors;
+            Array<Array<ngbla::integer>> tentpivots;
+            Array<size_t> slotndof;       // size of the factored system of a slot
+            Array<atomic<int>> slotstate; // 0 empty, 1 factorizing, 2 factorized
+            // tents per dependency level, for batched scheduling
+            int batchsize = 0;
+            Table<int> tentlevels;
+            // one heap per thread, kept over tents and Propagate calls
+            Array<shared_ptr<LocalHeap>> threadheaps;
 
             template<typename TFUNC>
             void CalcTentEl(int elnr, const Tent* tent, ScalarMappedElement<D+1> &tel, TFUNC LocalWavespeed,
-                    SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec, SliceMatrix<SIMD<double>> simddshapes);
+                    SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec, SliceMatrix<SIMD<double>> simddshapes, bool calcmat = true);
 
-            void CalcTentBndEl(int surfel, const Tent* tent, ScalarMappedElement<D+1> &tel, SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec);
+            void CalcTentBndEl(int surfel, const Tent* tent, ScalarMappedElement<D+1> &tel, SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec, bool calcmat = true);
 
             void CalcTentMacroEl(int fnr, const Array<int> &elnums, std::unordered_map<int,int> &macroel, const Tent* tent, ScalarMappedElement<D+1> &tel, SIMD_IntegrationRule &sir, LocalHeap &slh, SliceMatrix<> elmat, SliceVector<> elvec);
 
@@ -53,9 +68,40 @@ namespace ngcomp
             template<typename T=double>
             void SwapIfGreater(T& a, T& b);
 
-            double TentAdiam(const Tent* tent);
+            double TentAdiam(const Tent* tent, LocalHeap & lh);
 
-            inline void Solve(FlatMatrix<double> a, FlatVector<double> b);
+            // LU factorization of the (nonsymmetric) tent matrix in place,
+            // and the solution with the factors
+            inline void Factorize(FlatMatrix<double> a, FlatArray<ngbla::integer> ipiv);
+            inline void SolveFactorized(FlatMatrix<double> a, FlatArray<ngbla::integer> ipiv, FlatVector<double> b);
+            inline void Solve(FlatMatrix<double> a, FlatVector<double> b, LocalHeap & lh);
+
+            void PrepareFactorCache();
+            void ClearFactorCache();
+            // assigns the same slot to tents with equal translated geometry and wavespeed
+            int ClassifyTents();
+            // true if the slot of the tent holds factors of a system of size n
+            bool IsFactored(int tentnr, size_t n) const
+            {
+                if(!cachefactors) return false;
+                int slot = tentslot[tentnr];
+                return slotstate[slot] == 2 && slotndof[slot] == n;
+            }
+            // solves with the cached factors, or factorizes a and caches the factors
+            void SolveCached(int tentnr, bool factored, FlatMatrix<double> a, FlatVector<double> b, LocalHeap & lh);
+
+            void MakeTentLevels();
+            // sets up the heap pool, not thread safe
+            void MakeThreadHeaps();
+            LocalHeap & ThreadHeap() { return *threadheaps[TaskManager::GetThreadId()]; }
+            // calls func(tentnr, slh) for all tents, in dependency order or level by level in batches
+            template<typename TFUNC>
+            void RunTents(TFUNC func);
+            // calls func(tents, slh) for batches of independent tents, level by level
+            template<typename TFUNC>
+            void RunTentBatches(TFUNC func);
+            // solves the systems mats[l]*x = vecs[l] of equal size n, SIMD across systems
+            void SolveBatch(size_t n, FlatArray<double*> mats, FlatArray<double*> vecs, LocalHeap & lh);
 
             inline int MakeMacroEl(const Array<int> &tentel, std::unordered_map<int,int> &macroel);
 
@@ -102,8 +148,24 @@ namespace ngcomp
                     fosystem=1;
                     nbasis = BinCoeff(D + order, order) + BinCoeff(D + order-1, order-1) - 1;
                 }
+                ClearFactorCache();
+            }
+
+            // keep the tent factorizations of the first slab for later slabs,
+            // only valid for time independent coefficients. With classes the
+            // factorization is shared by all tents congruent up to translation
+            void SetCacheFactorizations(bool cache, bool classes = false) {
+                cachefactors = cache;
+                cacheclasses = cache && classes;
+                ClearFactorCache();
             }
 
+            // process the independent tents of a dependency level in batches
+            // of this size, 0 schedules single tents by their dependencies.
+            // Without cached factorizations the tent systems of a batch are
+            // solved together, SIMD across tents of equal size
+            void SetBatchSize(int abatchsize) { batchsize = abatchsize; }
+
             void SetBoundaryCF(shared_ptr<CoefficientFunction> abddatum) override { bddatum = abddatum;}
 
             double Error(Matrix<> wavefront, Matrix<> wavefront_corr);
@@ -131,6 +193,7 @@ namespace ngcomp
             double TentXdiam(const Tent* tent);
 
             using TWaveTents<D>::Solve;
+            using TWaveTents<D>::SolveCached;
             using TWaveTents<D>::TentFaceVerts;
 
         public:
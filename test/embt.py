@@ -5,6 +5,7 @@ from ngstrefftz import *
 import time
 from netgen.geom2d import unit_square
 from netgen.csg import unit_cube
+from ngsolve.meshes import MakeStructured2DMesh
 
 order = 5
 exactlap = exp(x)*sin(y)
@@ -12,6 +13,7 @@ exactpoi = sin(x)*sin(y)
 eps = 10**-8
 mesh2d = Mesh(unit_square.GenerateMesh(maxh=0.3))
 mesh3d = Mesh(unit_cube.GenerateMesh(maxh = 1))
+meshstruct = MakeStructured2DMesh(quads=False, nx=4, ny=4)
 SetNumThreads(3)
 
 Lap = lambda u : sum(Trace(u.Operator('hesse')))
@@ -36,17 +38,8 @@ def dglap(fes,bndc,rhs=0):
     u = fes.TrialFunction()
     v = fes.TestFunction()
 
-    jump_u = u-u.Other()
-    jump_v = v-v.Other()
-    mean_dudn = 0.5*n * (grad(u)+grad(u.Other()))
-    mean_dvdn = 0.5*n * (grad(v)+grad(v.Other()))
-
     a = BilinearForm(fes)
-    a += grad(u)*grad(v) * dx \
-        +alpha*order**2/h*jump_u*jump_v * dx(skeleton=True) \
-        +(-mean_dudn*jump_v-mean_dvdn*jump_u) * dx(skeleton=True) \
-        +alpha*order**2/h*u*v * ds(skeleton=True) \
-        +(-n*grad(u)*v-n*grad(v)*u)* ds(skeleton=True)
+    a += dglapbf(fes)
     a.Assemble()
 
     f = LinearForm(fes)
@@ -57,6 +50,30 @@ def dglap(fes,bndc,rhs=0):
     return a,f
 
 
+def dglapbf(fes,bnd=True):
+    mesh = fes.mesh
+    order = fes.globalorder
+    alpha = 4
+    n = specialcf.normal(mesh.dim)
+    h = specialcf.mesh_size
+    u = fes.TrialFunction()
+    v = fes.TestFunction()
+
+    jump_u = u-u.Other()
+    jump_v = v-v.Other()
+    mean_dudn = 0.5*n * (grad(u)+grad(u.Other()))
+    mean_dvdn = 0.5*n * (grad(v)+grad(v.Other()))
+
+    bf = grad(u)*grad(v) * dx \
+        +alpha*order**2/h*jump_u*jump_v * dx(skeleton=True) \
+        +(-mean_dudn*jump_v-mean_dvdn*jump_u) * dx(skeleton=True)
+    if not bnd:
+        return bf
+    return bf \
+        +alpha*order**2/h*u*v * ds(skeleton=True) \
+        +(-n*grad(u)*v-n*grad(v)*u)* ds(skeleton=True)
+
+
 ########################################################################
 # PySVDTrefftz
 ########################################################################
@@ -133,11 +150,40 @@ def PySVDTrefftz(op,fes,eps):
 ########################################################################
 # EmbTrefftz
 ########################################################################
-def testembtrefftz(fes):
+def testembtrefftz(fes,**kwargs):
     """
     >>> fes = L2(mesh2d, order=order,  dgjumps=True)#,all_dofs_together=True)
     >>> testembtrefftz(fes) # doctest:+ELLIPSIS
     8...e-09
+
+    reuse the element SVDs on a structured mesh
+    >>> fes = L2(meshstruct, order=order,  dgjumps=True)
+    >>> abs(testembtrefftz(fes) - testembtrefftz(fes,reuse_svd=True)) < 1e-10
+    True
+
+    batched Jacobi SVD
+    >>> fes = L2(mesh2d, order=order,  dgjumps=True)
+    >>> testembtrefftz(fes,method="jacobi") # doctest:+ELLIPSIS
+    8...e-09
+
+    eigen decomposition of the symmetric element matrices
+    >>> testembtrefftz(fes,method="hermitian") # doctest:+ELLIPSIS
+    8...e-09
+
+    single precision SVD, null space refined in double, on all elements
+    >>> stats = TrefftzEmbeddingStats()
+    >>> testembtrefftz(fes,method="mixed",stats=stats) # doctest:+ELLIPSIS
+    8...e-09
+    >>> stats.nmixed == mesh2d.ne
+    True
+
+    iterative null space solver for high order, 41 harmonic polynomials of order 20,
+    all elements are decomposed iteratively and the error agrees with the SVD to 1e-10
+    >>> fes = L2(mesh2d, order=20,  dgjumps=True)
+    >>> stats = TrefftzEmbeddingStats()
+    >>> e = testembtrefftz(fes,tndof=41,method="lobpcg",stats=stats)
+    >>> stats.niterative == mesh2d.ne, abs(testembtrefftz(fes,tndof=41) - e) < 1e-10
+    (True, True)
     """
     start = time.time()
     mesh = fes.mesh
@@ -148,7 +194,7 @@ def testembtrefftz(fes):
     # op = grad(u)*grad(v) * dx
     # op = InnerProduct(u.Operator("hesse"),v.Operator("hesse"))*dx
     with TaskManager():
-        PP = TrefftzEmbedding(op,fes,eps)
+        PP = TrefftzEmbedding(op,fes,eps,**kwargs)
     # spspy(PP)
     PPT = PP.CreateTranspose()
     a,f = dglap(fes,exactlap)
@@ -163,11 +209,162 @@ def testembtrefftz(fes):
     return sqrt(Integrate((tpgfu-exactlap)**2, mesh))
 
 
-def testembtrefftz_mixed(fes):
+def testembtrefftz_helmholtz(fes,**kwargs):
+    """
+    quasi-Trefftz space of the Helmholtz operator on a complex space, the
+    element matrices are Hermitian and decomposed by zheevd, the plane wave
+    projection agrees with the one of the SVD embedding
+    >>> fes = L2(mesh2d, order=order, complex=True, dgjumps=True)
+    >>> e = testembtrefftz_helmholtz(fes)
+    >>> e < 1e-5, abs(testembtrefftz_helmholtz(fes,method="hermitian") - e) < 1e-10
+    (True, True)
+    >>> [t['counts'] for t in Timers() if t['name'] == 'GetSVDHermitian'][0] > 0
+    True
+    """
+    mesh = fes.mesh
+    k = 2
+    u,v = fes.TnT()
+    op = (Lap(u)+k**2*u)*(Lap(v)+k**2*v)*dx
+    with TaskManager():
+        PP = TrefftzEmbedding(op,fes,tndof=2*fes.globalorder+1,**kwargs)
+    PPT = PP.CreateTranspose()
+    # the Galerkin projection P (P^T M P)^-1 P^T M does not depend on the
+    # (complex) basis of the element null spaces
+    exact = exp(1j*k*(x+y)/sqrt(2))
+    m = BilinearForm(u*v*dx).Assemble()
+    f = LinearForm(exact*v*dx).Assemble()
+    TM = PPT@m.mat@PP
+    tpgfu = GridFunction(fes)
+    tpgfu.vec.data = PP*(TM.Inverse()*(PPT*f.vec))
+    return sqrt(Integrate((tpgfu-exact)*Conj(tpgfu-exact), mesh).real)
+
+
+def testembtrefftz_blockdiag(fes,fused=False,outfile="",patches=None):
+    """
+    >>> fes = L2(mesh2d, order=order,  dgjumps=True)#,all_dofs_together=True)
+    >>> testembtrefftz_blockdiag(fes) # doctest:+ELLIPSIS
+    8...e-09
+
+    reduced matrix assembled from the element and facet matrices
+    >>> testembtrefftz_blockdiag(fes,fused=True) # doctest:+ELLIPSIS
+    8...e-09
+
+    embedding written to and mapped from a file
+    >>> import os, tempfile
+    >>> testembtrefftz_blockdiag(fes,outfile=os.path.join(tempfile.mkdtemp(),"emb.bin")) # doctest:+ELLIPSIS
+    8...e-09
+
+    reduced system solved by CG with additive Schwarz preconditioners
+    >>> testembtrefftz_blockdiag(fes,patches=False) # doctest:+ELLIPSIS
+    8...e-09
+    >>> testembtrefftz_blockdiag(fes,patches=True) # doctest:+ELLIPSIS
+    8...e-09
+    """
+    mesh = fes.mesh
+    u,v = fes.TnT()
+    uh = u.Operator("hesse")
+    vh = v.Operator("hesse")
+    op = (uh[0,0]+uh[1,1])*(vh[0,0]+vh[1,1])*dx
+    with TaskManager():
+        PP = TrefftzEmbedding(op,fes,eps,blockdiag=True,outfile=outfile)
+    if outfile:
+        PP = LoadTrefftzEmbedding(outfile)
+    a,f = dglap(fes,exactlap)
+    if fused:
+        TA = PP.GalerkinProduct(dglapbf(fes),fes)
+    else:
+        TA = PP.GalerkinProduct(a.mat)
+    if patches is None:
+        TU = TA.Inverse()*(PP.T*f.vec)
+    else:
+        pre = PP.CreatePreconditioner(TA,patches=patches)
+        TU = solvers.CG(mat=TA,rhs=PP.T*f.vec,pre=pre,tol=1e-14,maxsteps=1000,printrates=False)
+    tpgfu = GridFunction(fes)
+    tpgfu.vec.data = PP*TU
+    return sqrt(Integrate((tpgfu-exactlap)**2, mesh))
+
+
+def testembtrefftz_galerkin(fes,bnd=True):
+    """
+    reduced matrix of the fused product and of the assembled matrix agree,
+    also for forms without boundary terms
+    >>> fes = L2(mesh2d, order=order,  dgjumps=True)
+    >>> testembtrefftz_galerkin(fes)
+    True
+    >>> testembtrefftz_galerkin(fes,bnd=False)
+    True
+    """
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    with TaskManager():
+        PP = TrefftzEmbedding(op,fes,eps,blockdiag=True)
+    bf = dglapbf(fes,bnd=bnd)
+    a = BilinearForm(bf).Assemble()
+    TA = PP.GalerkinProduct(bf,fes)
+    TAa = PP.GalerkinProduct(a.mat)
+    r = TA.CreateColVector()
+    r.SetRandom()
+    w = r.CreateVector()
+    w.data = TA*r - TAa*r
+    return Norm(w) < 1e-10*Norm(TAa*r)
+
+
+def testembtrefftz_update(fes):
+    """
+    only the changed elements are decomposed again, the updated embedding
+    spans the space of a full embedding and differs from the previous one
+    >>> fes = L2(mesh2d, order=order,  dgjumps=True)
+    >>> testembtrefftz_update(fes)
+    (True, True)
+    """
+    mesh = fes.mesh
+    u,v = fes.TnT()
+    uh = u.Operator("hesse")
+    vh = v.Operator("hesse")
+    op = lambda a : (a*uh[0,0]+uh[1,1])*(a*vh[0,0]+vh[1,1])*dx
+    # anisotropic Laplacian on the changed elements, the Trefftz space
+    # changes there but keeps its dimension
+    changed = BitArray(mesh.ne)
+    changed.Clear()
+    changed[0] = True
+    changed[mesh.ne-1] = True
+    aniso = GridFunction(L2(mesh, order=0))
+    aniso.vec[:] = 1
+    aniso.vec[0] = 2
+    aniso.vec[mesh.ne-1] = 2
+    with TaskManager():
+        PP = TrefftzEmbedding(op(1),fes,eps,blockdiag=True)
+        PPfull = TrefftzEmbedding(op(aniso),fes,eps,blockdiag=True)
+    # the columns are orthonormal, compare the projections onto the spaces
+    r = PP.CreateColVector()
+    r.SetRandom()
+    def proj(P):
+        w = r.CreateVector()
+        w.data = P*(P.T*r)
+        return w
+    w0 = proj(PP)
+    with TaskManager():
+        PP = TrefftzEmbedding(op(aniso),fes,eps,blockdiag=True,previous=PP,changed=changed)
+    w = proj(PP)
+    return Norm(w-proj(PPfull)) < 1e-8, Norm(w-w0) > 1e-3
+
+
+def testembtrefftz_mixed(fes,**kwargs):
     """
     >>> fes = L2(mesh2d, order=order,  dgjumps=True)#,all_dofs_together=True)
     >>> testembtrefftz_mixed(fes) # doctest:+ELLIPSIS
     8...e-09
+
+    null space from the eigen decomposition of elmat^T*elmat
+    >>> testembtrefftz_mixed(fes,method="eig") < 1e-7
+    True
+
+    equilibrated element matrices, relative threshold and statistics
+    >>> stats = TrefftzEmbeddingStats()
+    >>> testembtrefftz_mixed(fes,eps=0,releps=1e-10,equilibrate=True,stats=stats) < 1e-7
+    True
+    >>> set(stats.rank) == {(order-1)*order//2}, sum(stats.condhist) == len(stats.rank), stats.nsingular
+    (True, True, 0)
     """
     mesh = fes.mesh
     test_fes = L2(mesh, order=fes.globalorder-2,  dgjumps=True)#,all_dofs_together=True)
@@ -175,6 +372,30 @@ def testembtrefftz_mixed(fes):
     v=test_fes.TestFunction()
     op = Lap(u)*(v)*dx
     startsvd = time.time()
+    with TaskManager():
+        PP = TrefftzEmbedding(op,fes,test_fes=test_fes,**kwargs)
+    PPT = PP.CreateTranspose()
+    a,f = dglap(fes,exactlap)
+    TA = PPT@a.mat@PP
+    TU = TA.Inverse()*(PPT*f.vec)
+    tpgfu = GridFunction(fes)
+    tpgfu.vec.data = PP*TU
+    return sqrt(Integrate((tpgfu-exactlap)**2, mesh))
+
+
+def testembtrefftz_eb(fes):
+    """
+    weak Trefftz condition with element boundary terms
+    >>> fes = L2(mesh2d, order=order,  dgjumps=True)#,all_dofs_together=True)
+    >>> testembtrefftz_eb(fes) # doctest:+ELLIPSIS
+    8...e-09
+    """
+    mesh = fes.mesh
+    test_fes = L2(mesh, order=fes.globalorder-2,  dgjumps=True)
+    n = specialcf.normal(mesh.dim)
+    u=fes.TrialFunction()
+    v=test_fes.TestFunction()
+    op = -grad(u)*grad(v)*dx + (grad(u)*n)*v*dx(element_boundary=True)
     with TaskManager():
         PP = TrefftzEmbedding(op,fes,test_fes=test_fes)
     PPT = PP.CreateTranspose()
@@ -186,6 +407,33 @@ def testembtrefftz_mixed(fes):
     return sqrt(Integrate((tpgfu-exactlap)**2, mesh))
 
 
+def testembtrefftz_bnd(fes,skeleton=False):
+    """
+    boundary terms are added to the element matrices of the elements at the
+    boundary, there they remove the constants from the null space
+    >>> fes = H1(mesh2d, order=3)
+    >>> testembtrefftz_bnd(fes)
+    True
+
+    integrals over boundary facets, ds(skeleton=True)
+    >>> fes = L2(mesh2d, order=3)
+    >>> testembtrefftz_bnd(fes,skeleton=True)
+    True
+    """
+    mesh = fes.mesh
+    u,v = fes.TnT()
+    op = grad(u)*grad(v)*dx + u*v*ds(skeleton=skeleton)
+    stats = TrefftzEmbeddingStats()
+    with TaskManager():
+        PP = TrefftzEmbedding(op,fes,eps,blockdiag=True,stats=stats)
+    bndels = set()
+    for e in mesh.edges:
+        if len(e.elements) == 1:
+            bndels.add(e.elements[0].nr)
+    ndof = (fes.globalorder+1)*(fes.globalorder+2)//2
+    return all(stats.rank[i] == (ndof if i in bndels else ndof-1) for i in range(mesh.ne))
+
+
 def testembtrefftznonsym(fes):
     """
     >>> fes = L2(mesh2d, order=order,  dgjumps=True)#,all_dofs_together=True)
@@ -233,11 +481,42 @@ def testembtrefftzpoi(fes):
     return sqrt(Integrate((tpgfu-exactpoi)**2, mesh))
 
 
-def testembtrefftzpoi_mixed(fes):
+def testembtrefftzpoi_mixed(fes,**kwargs):
     """
     >>> fes = L2(mesh2d, order=order,  dgjumps=True)#,all_dofs_together=True)
     >>> testembtrefftzpoi_mixed(fes) # doctest:+ELLIPSIS
     3...e-09
+
+    the second call maps embedding and pseudo inverses from the cache
+    >>> import tempfile
+    >>> cache = tempfile.mkdtemp()
+    >>> abs(testembtrefftzpoi_mixed(fes,cachedir=cache) - testembtrefftzpoi_mixed(fes,cachedir=cache)) < 1e-12
+    True
+
+    truncated cache entries are computed again
+    >>> import os
+    >>> for f in os.listdir(cache):
+    ...     os.truncate(os.path.join(cache,f), 100)
+    >>> testembtrefftzpoi_mixed(fes,cachedir=cache) # doctest:+ELLIPSIS
+    3...e-09
+    >>> testembtrefftzpoi_mixed(fes,cachedir=cache) # doctest:+ELLIPSIS
+    3...e-09
+
+    so are entries of the right size with dofs out of range
+    >>> for f in os.listdir(cache):
+    ...     with open(os.path.join(cache,f),"r+b") as fh:
+    ...         _ = fh.seek(-4,os.SEEK_END)
+    ...         _ = fh.write(b"\xff\xff\xff\x7f")
+    >>> testembtrefftzpoi_mixed(fes,cachedir=cache) # doctest:+ELLIPSIS
+    3...e-09
+
+    the key covers the integration order and the regions of the integrals
+    >>> cache = tempfile.mkdtemp()
+    >>> u,v = fes.TnT()
+    >>> for dx_ in [dx, dx(bonus_intorder=2), dx(definedon=mesh2d.Materials(".*"))]:
+    ...     _ = TrefftzEmbedding(Lap(u)*Lap(v)*dx_,fes,eps,cachedir=cache)
+    >>> len([f for f in os.listdir(cache) if f.startswith("embedding_")])
+    3
     """
     mesh = fes.mesh
     test_fes = L2(mesh, order=fes.globalorder-2,  dgjumps=True)#,all_dofs_together=True)
@@ -247,7 +526,7 @@ def testembtrefftzpoi_mixed(fes):
     rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
     lop = -rhs*v*dx
     with TaskManager():
-        PP,ufv = TrefftzEmbedding(op,fes,lop,test_fes=test_fes)
+        PP,ufv = TrefftzEmbedding(op,fes,lop,test_fes=test_fes,**kwargs)
     PPT = PP.CreateTranspose()
     a,f = dglap(fes,exactpoi,rhs)
     TA = PPT@a.mat@PP
@@ -256,6 +535,31 @@ def testembtrefftzpoi_mixed(fes):
     tpgfu.vec.data = PP*TU+ufv
     return sqrt(Integrate((tpgfu-exactpoi)**2, mesh))
 
+def testembtrefftzpoi_pinv(fes):
+    """
+    >>> fes = L2(mesh2d, order=order,  dgjumps=True)
+    >>> testembtrefftzpoi_pinv(fes)
+    (True, True)
+    """
+    mesh = fes.mesh
+    test_fes = L2(mesh, order=fes.globalorder-2,  dgjumps=True)
+    u=fes.TrialFunction()
+    v=test_fes.TestFunction()
+    op = Lap(u)*(v)*dx
+    rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
+    lop = -rhs*v*dx
+    with TaskManager():
+        PP,ufv,PI = TrefftzEmbedding(op,fes,lop,test_fes=test_fes,pseudoinverse=True)
+    f = LinearForm(lop).Assemble()
+    single = (PI*f.vec - ufv).Norm() < 1e-10 * ufv.Norm()
+    F = MultiVector(f.vec, 2)
+    F[0].data = f.vec
+    F[1].data = 2*f.vec
+    U = MultiVector(ufv, 2)
+    PI.Apply(F, U)
+    multi = (U[1] - 2*ufv).Norm() < 1e-10 * ufv.Norm()
+    return single, multi
+
 
 
 if __name__ == "__main__":
@@ -0,0 +1,46 @@
+"""
+Trefftz embedding on a distributed mesh, compared with the serial embedding.
+Run with
+    mpirun -np 2 python3 embt_mpi.py
+"""
+from mpi4py import MPI
+from ngsolve import *
+from ngstrefftz import *
+from netgen.geom2d import unit_square
+import netgen.meshing
+
+order = 5
+exactlap = exp(x)*sin(y)
+eps = 10**-8
+
+def embtrefftz_l2proj(mesh):
+    # L2 projection onto the Trefftz space, the mass matrix does not couple
+    # elements of different ranks
+    fes = L2(mesh, order=order)
+    u,v = fes.TnT()
+    uh = u.Operator("hesse")
+    vh = v.Operator("hesse")
+    op = (uh[0,0]+uh[1,1])*(vh[0,0]+vh[1,1])*dx
+    PP = TrefftzEmbedding(op,fes,eps)
+    m = BilinearForm(u*v*dx).Assemble()
+    f = LinearForm(exactlap*v*dx).Assemble()
+    TA = PP.T@m.mat@PP
+    TU = solvers.CG(mat=TA,rhs=PP.T*f.vec,tol=1e-14,maxsteps=1000,printrates=False)
+    gfu = GridFunction(fes)
+    gfu.vec.data = PP*TU
+    return sqrt(Integrate((gfu-exactlap)**2, mesh))
+
+comm = MPI.COMM_WORLD
+if comm.rank == 0:
+    serialerror = embtrefftz_l2proj(Mesh(unit_square.GenerateMesh(maxh=0.3)))
+    ngmesh = unit_square.GenerateMesh(maxh=0.3)
+    ngmesh.Distribute(comm)
+else:
+    ngmesh = netgen.meshing.Mesh.Receive(comm)
+mesh = Mesh(ngmesh)
+error = embtrefftz_l2proj(mesh)
+
+if comm.rank == 0:
+    print("serial error", serialerror, "distributed error", error)
+    assert comm.size > 1, "run with mpirun -np 2"
+    assert abs(error-serialerror) < 1e-10
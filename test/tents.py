@@ -6,6 +6,7 @@ from netgen.geom2d import unit_square
 from netgen.csg import unit_cube
 from ngsolve.TensorProductTools import *
 from ngsolve import *
+from ngsolve.meshes import MakeStructured2DMesh
 import time
 
 # USE tenthight = wavespeed + 3
@@ -246,6 +247,80 @@ def SolveWaveTentsFO(initmesh, order, c, t_step):
     return error
 
 
+def SolveWaveTentsSlabs(initmesh, order, c, t_step, nslabs, cache, classes=False, batchsize=0, wavespeed=None):
+    """
+    Propagate several slabs, reusing the tent factorizations of the first one
+    >>> order = 4
+    >>> SetNumThreads(4)
+    >>> c = 1
+    >>> t_step = 0.25
+    >>> initmesh = Mesh(unit_square.GenerateMesh(maxh = 0.4))
+    >>> e0 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 4, False)
+    >>> e1 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 4, True)
+    >>> e0 < 0.01, abs(e0-e1) < 1e-10
+    (True, True)
+
+    congruent tents of a structured mesh share their factorization
+    >>> initmesh = MakeStructured2DMesh(quads=False, nx=8, ny=8)
+    >>> e0 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, False)
+    >>> e1 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, True, True)
+    >>> abs(e0-e1) < 1e-10
+    True
+
+    batches of independent tents of the same dependency level, solved
+    SIMD across tents, and with cached factorizations
+    >>> e1 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, False, False, 16)
+    >>> abs(e0-e1) < 1e-10
+    True
+    >>> e1 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, True, True, 16)
+    >>> abs(e0-e1) < 1e-10
+    True
+
+    a wavespeed varying in x, only tents along y are congruent
+    >>> wavespeed = 1+x/2
+    >>> e0 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, False, wavespeed=wavespeed)
+    >>> e1 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, True, True, wavespeed=wavespeed)
+    >>> abs(e0-e1) < 1e-10
+    True
+
+    a piecewise constant wavespeed, tents at the jump split into macro
+    elements and get larger systems than their neighbours
+    >>> wavespeed = IfPos(x-0.5, 2, 1)
+    >>> e0 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, False, wavespeed=wavespeed)
+    >>> e1 = SolveWaveTentsSlabs(initmesh, order, c, t_step, 2, True, True, wavespeed=wavespeed)
+    >>> abs(e0-e1) < 1e-10
+    True
+    """
+
+    D = initmesh.dim
+    t = CoordCF(D)
+
+    sq = sqrt(2.0);
+    bdd = CoefficientFunction((
+        sin(math.pi*x)*sin(math.pi*y)*sin(math.pi*t*c*sq)/(sq*math.pi),
+        cos(math.pi*x)*sin(math.pi*y)*sin(math.pi*t*c*sq)/sq,
+        sin(math.pi*x)*cos(math.pi*y)*sin(math.pi*t*c*sq)/sq,
+        sin(math.pi*x)*sin(math.pi*y)*cos(math.pi*t*c*sq)*c
+        ))
+
+    if wavespeed is None:
+        wavespeed = CoefficientFunction(c)
+    ts = TentSlab(initmesh, method="edge", heapsize=10*1000*1000)
+    ts.SetMaxWavespeed(wavespeed)
+    ts.PitchTents(dt=t_step, local_ct=True, global_ct=2/3)
+    TT=TWave(order,ts,wavespeed)
+    TT.SetInitial(bdd)
+    TT.SetBoundaryCF(bdd[D+1])
+    TT.SetCacheFactorizations(cache, classes)
+    TT.SetBatchSize(batchsize)
+
+    with TaskManager():
+        for n in range(nslabs):
+            TT.Propagate()
+
+    return TT.Error(TT.GetWavefront(),TT.MakeWavefront(bdd,nslabs*t_step))
+
+
 if __name__ == "__main__":
     # order = 4
     # SetNumThreads(1)
@@ -296,5 +371,12 @@ if __name__ == "__main__":
         # print("time to solve on ",2**i," threads ",time.time()-start)
         # input()
 
+    # compare single tent scheduling with batches, small order
+    # initmesh = MakeStructured2DMesh(quads=False, nx=64, ny=64)
+    # for batchsize in [0,16,64]:
+        # start = time.time()
+        # SolveWaveTentsSlabs(initmesh, 2, 1, 0.05, 4, False, batchsize=batchsize)
+        # print("batchsize", batchsize, "time", time.time()-start)
+
     import doctest
     doctest.testmod()